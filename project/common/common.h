@@ -19,7 +19,7 @@
 #define ERROR_MSG_SIZE 1024
 #define BOX_RESPONSE OPCODE_SIZE + RETURN_CODE_SIZE + ERROR_MSG_SIZE
 #define MAX_N_BOXES 23
-#define BOX_SIZE 1024
+#define BOX_SIZE (4 * 1024 * 1024)
 #define LAST_SIZE (ssize_t)sizeof(uint8_t)
 #define LIST_REQUEST_SIZE OPCODE_SIZE + PIPENAME_SIZE
 
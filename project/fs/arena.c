@@ -0,0 +1,147 @@
+// madvise and the anonymous mapping flags aren't part of POSIX
+#define _DEFAULT_SOURCE
+
+#include "arena.h"
+#include "config.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/*
+ * Memory arena holding the FS when it isn't kept in an image file.
+ *
+ * The arena is an anonymous mapping whose pages are only committed when
+ * they're first written (so a large FS only takes up the memory it uses), and
+ * that may instead be committed up front by a background thread, so writes
+ * don't fault, or be backed by transparent huge pages, so fewer TLB entries
+ * cover it.
+ */
+
+static char *arena_base = NULL; // NULL if there's no arena
+static size_t arena_size;
+static size_t arena_offset; // of the memory handed out, from arena_base
+
+static pthread_t arena_prefault_thread;
+static bool arena_prefaulting = false; // whether the thread was started
+static atomic_bool arena_stop_prefault;
+
+/**
+ * Commit every page of the arena, a chunk at a time, without changing their
+ * contents (which may already be in use).
+ *
+ * Input:
+ *   - arg: unused
+ */
+static void *arena_prefault(void *arg) {
+    (void)arg;
+
+#ifdef MADV_POPULATE_WRITE
+    for (size_t offset = 0; offset < arena_size;
+         offset += ARENA_PREFAULT_CHUNK) {
+        if (atomic_load_explicit(&arena_stop_prefault, memory_order_relaxed)) {
+            break; // the FS is being destroyed
+        }
+
+        size_t len = arena_size - offset;
+        if (len > ARENA_PREFAULT_CHUNK) {
+            len = ARENA_PREFAULT_CHUNK;
+        }
+        if (madvise(arena_base + offset, len, MADV_POPULATE_WRITE) == -1) {
+            WARN("failed to prefault the FS memory: %d", errno);
+            break;
+        }
+    }
+#else
+    WARN("prefaulting isn't supported, the FS memory is committed lazily");
+#endif
+
+    return NULL;
+}
+
+/**
+ * Allocate the arena.
+ *
+ * Input:
+ *   - size: size of the memory to allocate (zeroed)
+ *   - mode: how the memory is committed
+ *
+ * Returns the memory if successful, NULL otherwise.
+ *
+ * Possible errors:
+ *   - There's already an arena.
+ *   - Unknown mode.
+ *   - mmap failure.
+ */
+void *arena_alloc(size_t size, tfs_arena_mode_t mode) {
+    if (arena_base != NULL) {
+        return NULL; // already allocated
+    }
+
+    // huge pages only back whole, aligned, huge page sized ranges, so the
+    // arena is padded to be aligned
+    size_t alignment = mode == TFS_ARENA_HUGE ? ARENA_HUGE_PAGE_SIZE : 0;
+    size_t map_size = size + alignment;
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    arena_base = map;
+    arena_size = map_size;
+    arena_offset = 0;
+    if (alignment > 0) {
+        arena_offset = (alignment - (uintptr_t)map % alignment) % alignment;
+    }
+
+    switch (mode) {
+    case TFS_ARENA_LAZY:
+        break;
+    case TFS_ARENA_PREFAULT:
+        atomic_init(&arena_stop_prefault, false);
+        arena_prefaulting = pthread_create(&arena_prefault_thread, NULL,
+                                           arena_prefault, NULL) == 0;
+        if (!arena_prefaulting) {
+            WARN("failed to start prefaulting the FS memory");
+        }
+        break;
+    case TFS_ARENA_HUGE:
+        if (madvise(arena_base, arena_size, MADV_HUGEPAGE) == -1) {
+            WARN("huge pages aren't available, the FS uses regular pages");
+        }
+        break;
+    default:
+        munmap(arena_base, arena_size);
+        arena_base = NULL;
+        return NULL; // unknown mode
+    }
+
+    return arena_base + arena_offset;
+}
+
+/**
+ * Free the arena.
+ *
+ * Input:
+ *   - arena: memory returned by arena_alloc
+ */
+void arena_free(void *arena) {
+    if (arena_base == NULL || arena != arena_base + arena_offset) {
+        return;
+    }
+
+    if (arena_prefaulting) {
+        atomic_store_explicit(&arena_stop_prefault, true,
+                              memory_order_relaxed);
+        pthread_join(arena_prefault_thread, NULL);
+        arena_prefaulting = false;
+    }
+
+    munmap(arena_base, arena_size);
+    arena_base = NULL;
+}
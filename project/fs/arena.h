@@ -0,0 +1,11 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "operations.h"
+
+#include <stddef.h>
+
+void *arena_alloc(size_t size, tfs_arena_mode_t mode);
+void arena_free(void *arena);
+
+#endif // ARENA_H
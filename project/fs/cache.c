@@ -0,0 +1,506 @@
+#include "cache.h"
+#include "betterassert.h"
+#include "config.h"
+#include "latency.h"
+#include "locks.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Cache of the data blocks of the FS image, used when they're read from and
+ * written to the image file instead of being mapped in memory.
+ *
+ * A fixed number of frames hold the blocks in use. A block stays in its frame
+ * while it's pinned (between block_cache_get and block_cache_put); the other
+ * frames are reused in CLOCK order, writing their block back to the image
+ * file first if it was changed (write-back).
+ *
+ * Only leases (block_cache_lease) keep blocks pinned between calls, so they
+ * can only take half of the frames: the others are pinned by operations in
+ * progress, for a while, and so a frame is always freed up eventually.
+ */
+
+/**
+ * Cache frame
+ */
+typedef struct {
+    int block_number;  // -1 if the frame is empty
+    unsigned pins;     // users of the block, which can't be evicted meanwhile
+    unsigned leases;   // pins held by leases
+    bool referenced;   // used since the clock hand last went by
+    bool loading;      // its block is being read (and the evicted one written
+                       // back), with the cache unlocked
+    atomic_bool dirty; // changed since it was last written back
+    pthread_cond_t loaded_cond; // signals the frame's block was loaded
+    // held for writing while the block is changed, and for reading while it's
+    // written back by block_cache_flush
+    pthread_rwlock_t lock;
+} cache_frame_t;
+
+static int cache_fd = -1; // -1 if the cache isn't used
+static size_t cache_data_offset; // of the first data block, in the image file
+static size_t cache_block_size;
+static size_t cache_block_count;
+
+static cache_frame_t *cache_frames;
+static char *cache_data; // contents of the blocks in each frame
+static size_t cache_frame_count;
+static int *cache_block_frames;    // frame of each block (-1 if not cached)
+static size_t cache_hand;          // next frame considered for eviction
+static size_t cache_leased_frames; // frames pinned by leases
+
+// Protects the frames' blocks, pins, leases, reference bits and loading
+// flags, the block to frame map, the clock hand and the leased frame count;
+// the image file is read and written without it, by whoever is loading the
+// frame
+static pthread_mutex_t cache_lock;
+static pthread_cond_t cache_unpinned_cond; // signals a frame was unpinned
+
+// Statistics
+static atomic_uint_fast64_t cache_hits;
+static atomic_uint_fast64_t cache_misses;
+static atomic_uint_fast64_t cache_writebacks;
+
+/**
+ * Start caching the data blocks of an image file.
+ *
+ * Input:
+ *   - image_fd: the image file, open for reading and writing
+ *   - data_offset: offset of the first data block in the image file
+ *   - block_size: size of a data block
+ *   - block_count: number of data blocks
+ *   - frame_count: number of blocks kept in memory (at least
+ *     BLOCK_CACHE_MIN_FRAMES)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+int block_cache_init(int image_fd, size_t data_offset, size_t block_size,
+                     size_t block_count, size_t frame_count) {
+    if (frame_count < BLOCK_CACHE_MIN_FRAMES) {
+        frame_count = BLOCK_CACHE_MIN_FRAMES;
+    }
+    if (frame_count > block_count) {
+        frame_count = block_count; // every block fits
+    }
+
+    cache_frames = malloc(frame_count * sizeof(cache_frame_t));
+    cache_data = malloc(frame_count * block_size);
+    cache_block_frames = malloc(block_count * sizeof(int));
+    if (!cache_frames || !cache_data || !cache_block_frames) {
+        free(cache_frames);
+        free(cache_data);
+        free(cache_block_frames);
+        return -1; // allocation failed
+    }
+
+    for (size_t i = 0; i < frame_count; i++) {
+        cache_frames[i].block_number = -1;
+        cache_frames[i].pins = 0;
+        cache_frames[i].leases = 0;
+        cache_frames[i].referenced = false;
+        cache_frames[i].loading = false;
+        atomic_init(&cache_frames[i].dirty, false);
+        cond_init(&cache_frames[i].loaded_cond);
+        rwl_init(&cache_frames[i].lock);
+    }
+    for (size_t i = 0; i < block_count; i++) {
+        cache_block_frames[i] = -1;
+    }
+
+    mutex_init(&cache_lock);
+    cond_init(&cache_unpinned_cond);
+
+    cache_fd = image_fd;
+    cache_data_offset = data_offset;
+    cache_block_size = block_size;
+    cache_block_count = block_count;
+    cache_frame_count = frame_count;
+    cache_hand = 0;
+    cache_leased_frames = 0;
+
+    return 0;
+}
+
+/**
+ * Stop caching, writing every changed block back to the image file (and
+ * resetting the statistics).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int block_cache_destroy(void) {
+    if (cache_fd == -1) {
+        return 0; // not cached
+    }
+
+    int ret = block_cache_flush();
+
+    for (size_t i = 0; i < cache_frame_count; i++) {
+        cond_destroy(&cache_frames[i].loaded_cond);
+        rwl_destroy(&cache_frames[i].lock);
+    }
+    mutex_destroy(&cache_lock);
+    cond_destroy(&cache_unpinned_cond);
+
+    free(cache_frames);
+    free(cache_data);
+    free(cache_block_frames);
+    cache_frames = NULL;
+    cache_data = NULL;
+    cache_block_frames = NULL;
+    cache_fd = -1;
+    atomic_store_explicit(&cache_hits, 0, memory_order_relaxed);
+    atomic_store_explicit(&cache_misses, 0, memory_order_relaxed);
+    atomic_store_explicit(&cache_writebacks, 0, memory_order_relaxed);
+
+    return ret;
+}
+
+/**
+ * Obtain the frame holding an address.
+ *
+ * Input:
+ *   - addr: the address
+ *
+ * Returns the index of the frame, or -1 if the address isn't in the cache.
+ */
+static ssize_t cache_frame_of(void const *addr) {
+    char const *byte = addr;
+    if (cache_fd == -1 || byte < cache_data ||
+        byte >= cache_data + cache_frame_count * cache_block_size) {
+        return -1;
+    }
+
+    return (ssize_t)((size_t)(byte - cache_data) / cache_block_size);
+}
+
+/**
+ * Write the contents of a frame back to the image file.
+ *
+ * Must be called with the frame pinned.
+ *
+ * Input:
+ *   - index: index of the frame
+ *   - block_number: the block they belong to
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int cache_frame_write(size_t index, int block_number) {
+    off_t offset = (off_t)(cache_data_offset +
+                           (size_t)block_number * cache_block_size);
+    atomic_fetch_add_explicit(&cache_writebacks, 1, memory_order_relaxed);
+
+    return pwrite(cache_fd, cache_data + index * cache_block_size,
+                  cache_block_size, offset) == (ssize_t)cache_block_size
+               ? 0
+               : -1;
+}
+
+/**
+ * Choose the frame where a block will be loaded (CLOCK): the first unpinned
+ * frame the hand finds without its reference bit, clearing the bits on the way.
+ *
+ * Must be called with the cache locked; waits while every frame is pinned
+ * (which, as leases only take half of them, doesn't last).
+ *
+ * Returns the index of the frame.
+ */
+static size_t cache_victim(void) {
+    while (1) {
+        // two turns clear every reference bit, so an unpinned frame is found
+        for (size_t i = 0; i < 2 * cache_frame_count; i++) {
+            size_t index = cache_hand;
+            cache_hand = (cache_hand + 1) % cache_frame_count;
+
+            cache_frame_t *frame = &cache_frames[index];
+            if (frame->pins > 0) {
+                continue; // (including the frames being loaded)
+            }
+            if (frame->referenced) {
+                frame->referenced = false; // second chance
+                continue;
+            }
+
+            return index;
+        }
+
+        cond_wait(&cache_unpinned_cond, &cache_lock);
+    }
+}
+
+/**
+ * Pin a block in the cache, loading it from the image file if needed.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - edit: whether the block will be changed; until block_cache_edited is
+ *     called, no one else changes it or writes it back
+ *   - lease: whether the pin is held by a lease
+ *
+ * Returns a pointer to the first byte of the block, or NULL if it's for a
+ * lease and the leases already take half of the frames.
+ */
+static void *cache_pin(int block_number, bool edit, bool lease) {
+    ALWAYS_ASSERT(block_number >= 0 && (size_t)block_number < cache_block_count,
+                  "block_cache_get: invalid block number");
+
+    mutex_lock(&cache_lock);
+    int index = cache_block_frames[block_number];
+    while (index != -1 && cache_frames[index].loading) {
+        // The block is being loaded, or evicted from its frame; only that
+        // frame is waited for
+        cond_wait(&cache_frames[index].loaded_cond, &cache_lock);
+        index = cache_block_frames[block_number];
+    }
+
+    if (lease && (index == -1 || cache_frames[index].leases == 0)) {
+        if (cache_leased_frames >= cache_frame_count / 2) {
+            mutex_unlock(&cache_lock);
+            return NULL; // the other frames are kept for everything else
+        }
+        cache_leased_frames++;
+    }
+
+    if (index != -1) {
+        atomic_fetch_add_explicit(&cache_hits, 1, memory_order_relaxed);
+
+        cache_frame_t *frame = &cache_frames[index];
+        frame->pins++;
+        if (lease) {
+            frame->leases++;
+        }
+        frame->referenced = true;
+        mutex_unlock(&cache_lock);
+    } else {
+        atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+
+        // The frame is pinned and marked as loading, so that the block can be
+        // loaded with the cache unlocked: both its new block and the evicted
+        // one stay mapped to it until then, and whoever wants them waits
+        index = (int)cache_victim();
+        cache_frame_t *frame = &cache_frames[index];
+        int evicted = frame->block_number;
+        bool write_back = evicted != -1 &&
+                          atomic_exchange_explicit(&frame->dirty, false,
+                                                   memory_order_relaxed);
+        frame->pins++;
+        if (lease) {
+            frame->leases++;
+        }
+        frame->referenced = true;
+        frame->loading = true;
+        frame->block_number = block_number;
+        cache_block_frames[block_number] = index;
+        mutex_unlock(&cache_lock);
+
+        if (write_back && cache_frame_write((size_t)index, evicted) == -1) {
+            PANIC("block_cache_get: couldn't write a block back")
+        }
+        if (evicted != -1) {
+            // (now read from the image file again)
+            mutex_lock(&cache_lock);
+            cache_block_frames[evicted] = -1;
+            cond_broadcast(&frame->loaded_cond);
+            mutex_unlock(&cache_lock);
+        }
+
+        // only misses reach the image file
+        insert_delay(TFS_ACCESS_BLOCK);
+        off_t offset = (off_t)(cache_data_offset +
+                               (size_t)block_number * cache_block_size);
+        if (pread(cache_fd, cache_data + (size_t)index * cache_block_size,
+                  cache_block_size, offset) != (ssize_t)cache_block_size) {
+            PANIC("block_cache_get: couldn't read a block")
+        }
+
+        mutex_lock(&cache_lock);
+        frame->loading = false;
+        cond_broadcast(&frame->loaded_cond);
+        mutex_unlock(&cache_lock);
+    }
+
+    if (edit) {
+        rwl_wrlock(&cache_frames[index].lock);
+    }
+
+    return cache_data + (size_t)index * cache_block_size;
+}
+
+/**
+ * Pin a block in the cache, loading it from the image file if needed.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - edit: whether the block will be changed; until block_cache_edited is
+ *     called, no one else changes it or writes it back
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void *block_cache_get(int block_number, bool edit) {
+    return cache_pin(block_number, edit, false);
+}
+
+/**
+ * Pin a block in the cache for a lease, loading it from the image file if
+ * needed. It's unpinned with block_cache_lease_put.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns a pointer to the first byte of the block, or NULL if the leases
+ * already take half of the frames.
+ */
+void const *block_cache_lease(int block_number) {
+    return cache_pin(block_number, false, true);
+}
+
+/**
+ * Mark a block pinned with block_cache_get to be changed as changed, letting
+ * it be written back again. It stays pinned.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void block_cache_edited(void const *addr) {
+    ssize_t index = cache_frame_of(addr);
+    if (index == -1) {
+        return; // not cached
+    }
+
+    cache_frame_t *frame = &cache_frames[index];
+    atomic_store_explicit(&frame->dirty, true, memory_order_relaxed);
+    rwl_unlock(&frame->lock);
+}
+
+/**
+ * Unpin a block.
+ *
+ * Input:
+ *   - addr: an address in the block
+ *   - lease: whether the pin was held by a lease
+ */
+static void cache_unpin(void const *addr, bool lease) {
+    ssize_t index = cache_frame_of(addr);
+    if (index == -1) {
+        return; // not cached
+    }
+
+    cache_frame_t *frame = &cache_frames[index];
+    mutex_lock(&cache_lock);
+    ALWAYS_ASSERT(frame->pins > 0, "block_cache_put: block isn't pinned");
+    if (lease && --frame->leases == 0) {
+        cache_leased_frames--;
+    }
+    if (--frame->pins == 0) {
+        cond_broadcast(&cache_unpinned_cond);
+    }
+    mutex_unlock(&cache_lock);
+}
+
+/**
+ * Unpin a block pinned with block_cache_get. Addresses outside the cache are
+ * ignored.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void block_cache_put(void const *addr) { cache_unpin(addr, false); }
+
+/**
+ * Unpin a block pinned with block_cache_lease. Addresses outside the cache are
+ * ignored.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void block_cache_lease_put(void const *addr) { cache_unpin(addr, true); }
+
+/**
+ * Obtain the offset in the image file of an address in a pinned block.
+ *
+ * Input:
+ *   - addr: the address
+ *
+ * Returns the offset, or -1 if the address isn't in the cache.
+ */
+ssize_t block_cache_offset(void const *addr) {
+    ssize_t index = cache_frame_of(addr);
+    if (index == -1) {
+        return -1; // not cached
+    }
+
+    size_t offset = (size_t)((char const *)addr - cache_data) -
+                    (size_t)index * cache_block_size;
+    return (ssize_t)(cache_data_offset +
+                     (size_t)cache_frames[index].block_number *
+                         cache_block_size +
+                     offset);
+}
+
+/**
+ * Write every changed block back to the image file, and sync it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int block_cache_flush(void) {
+    if (cache_fd == -1) {
+        return 0; // not cached
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < cache_frame_count; i++) {
+        cache_frame_t *frame = &cache_frames[i];
+
+        mutex_lock(&cache_lock);
+        // (a frame being loaded was already written back, if needed)
+        if (frame->block_number == -1 || frame->loading ||
+            !atomic_load_explicit(&frame->dirty, memory_order_relaxed)) {
+            mutex_unlock(&cache_lock);
+            continue;
+        }
+        frame->pins++; // so that it isn't evicted meanwhile
+        int block_number = frame->block_number;
+        mutex_unlock(&cache_lock);
+
+        // waits for the block to be consistent
+        rwl_rdlock(&frame->lock);
+        if (atomic_exchange_explicit(&frame->dirty, false,
+                                     memory_order_relaxed) &&
+            cache_frame_write(i, block_number) == -1) {
+            atomic_store_explicit(&frame->dirty, true, memory_order_relaxed);
+            ret = -1;
+        }
+        rwl_unlock(&frame->lock);
+
+        mutex_lock(&cache_lock);
+        if (--frame->pins == 0) {
+            cond_broadcast(&cache_unpinned_cond);
+        }
+        mutex_unlock(&cache_lock);
+    }
+
+    if (fdatasync(cache_fd) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Get the cache statistics (all 0 if the cache isn't used).
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ */
+void block_cache_stats(tfs_cache_stats_t *stats) {
+    stats->hits = atomic_load_explicit(&cache_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache_misses, memory_order_relaxed);
+    stats->writebacks =
+        atomic_load_explicit(&cache_writebacks, memory_order_relaxed);
+}
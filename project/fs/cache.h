@@ -0,0 +1,24 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+int block_cache_init(int image_fd, size_t data_offset, size_t block_size,
+                     size_t block_count, size_t frame_count);
+int block_cache_destroy(void);
+
+void *block_cache_get(int block_number, bool edit);
+void block_cache_edited(void const *addr);
+void block_cache_put(void const *addr);
+void const *block_cache_lease(int block_number);
+void block_cache_lease_put(void const *addr);
+ssize_t block_cache_offset(void const *addr);
+int block_cache_flush(void);
+
+void block_cache_stats(tfs_cache_stats_t *stats);
+
+#endif // CACHE_H
@@ -6,6 +6,50 @@
 
 #define MAX_FILE_NAME (40)
 
+// Maximum number of symlinks followed to open a file, so that loops of
+// symlinks fail instead of being followed forever
+#define SYMLINK_MAX_DEPTH (8)
+
+// Size of a cache line, which the per-inode and per-open file state is
+// aligned to
+#define CACHE_LINE_SIZE (64)
+
+// Default busy loop iterations per access to the FS state (TFS_LATENCY_SPIN)
 #define DELAY (5000)
 
+// Number of direct data block pointers kept in each inode
+#define INODE_DIRECT_BLOCKS (10)
+
+// Maximum size of the files whose data is kept in their inode, instead of in
+// data blocks (see inode_t)
+#define INODE_INLINE_SIZE (128)
+
+// Size of each of the journal's (in memory) record buffers; a buffer is
+// flushed early once it's half full
+#define JOURNAL_BUFFER_SIZE (1024 * 1024)
+
+// Size the journal file may reach before the image is synced and the journal
+// emptied
+#define JOURNAL_MAX_SIZE (16 * 1024 * 1024)
+
+// Minimum number of data blocks the block cache holds; every thread may pin a
+// couple of blocks at once, and each read lease pins one
+#define BLOCK_CACHE_MIN_FRAMES (64)
+
+// Size of the chunks in which tfs_copy_from_external_fs writes the (mapped)
+// source file
+#define IMPORT_CHUNK_SIZE (1024 * 1024)
+
+// Number of blocks tfs_copy_to_external_fs leases at once, to write them to
+// the destination file together (well below half of BLOCK_CACHE_MIN_FRAMES,
+// which is as many as the leases can keep in the block cache)
+#define EXPORT_BATCH_LEASES (16)
+
+// Size of the huge pages backing the FS memory (TFS_ARENA_HUGE)
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Size of the chunks in which the FS memory is committed in the background
+// (TFS_ARENA_PREFAULT), between which the FS may be destroyed
+#define ARENA_PREFAULT_CHUNK (2 * 1024 * 1024)
+
 #endif // CONFIG_H
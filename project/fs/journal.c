@@ -0,0 +1,535 @@
+#include "journal.h"
+#include "betterassert.h"
+#include "config.h"
+#include "locks.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Redo journal of the metadata updates made to the FS image.
+ *
+ * Each update is logged as a record holding the new contents of a range of the
+ * image. Records are appended to an in-memory buffer, which a flusher thread
+ * writes to the journal file as a batch (with a single sync) every flush
+ * interval, so that the updates of concurrent operations are committed
+ * together. Once the journal file grows past JOURNAL_MAX_SIZE, the image is
+ * synced and the journal emptied.
+ *
+ * The image is mapped with MAP_SHARED, so the kernel may write an update back
+ * to the image file before its batch is committed: the journal is redo-only,
+ * and it's the repair run after a crash (see state_recover) that leaves the
+ * image consistent, not write-ahead ordering.
+ */
+
+/**
+ * Journal batch header, written before the records of each batch
+ */
+typedef struct {
+    uint64_t magic;    // JOURNAL_MAGIC
+    uint64_t seq;      // batches are numbered consecutively
+    uint64_t length;   // length of the records following the header
+    uint64_t checksum; // of the records, to detect torn batches
+} journal_batch_t;
+
+/**
+ * Journal record header, followed by the new contents of the range
+ */
+typedef struct {
+    uint64_t offset; // start of the range in the image
+    uint64_t length; // length of the range
+} journal_record_t;
+
+#define JOURNAL_MAGIC (0x4c4e524a53465431u) // "1TFSJRNL"
+
+static int journal_fd = -1; // -1 if the FS isn't journaled
+static char *journal_image;
+static size_t journal_image_size;
+static int (*journal_sync_image)(void); // writes the image back and syncs it
+static size_t journal_flush_interval_ms;
+
+// Records are appended to the active buffer, while the flusher writes the
+// other one
+static char *journal_buffers[2];
+static char *journal_active;
+static size_t journal_active_size;
+
+static uint64_t journal_seq;         // seq of the active buffer's batch
+static uint64_t journal_flushed_seq; // last batch in the journal file
+static bool journal_flush_requested;
+static bool journal_stopping;
+static pthread_mutex_t journal_lock;
+static pthread_cond_t journal_flush_cond;   // wakes the flusher up
+static pthread_cond_t journal_flushed_cond; // signals a batch was flushed
+
+// Only used by the flusher
+static size_t journal_file_size;
+static pthread_t journal_flusher_tid;
+
+/**
+ * Compute the checksum of a batch's records (FNV-1a).
+ *
+ * Input:
+ *   - records: start of the records
+ *   - length: length of the records
+ *
+ * Returns the checksum.
+ */
+static uint64_t journal_checksum(char const *records, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)records[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+/**
+ * Obtain the path name of the journal file kept next to an image file.
+ *
+ * Input:
+ *   - image_path: path name of the image file
+ *
+ * Returns the (malloc'ed) path name, or NULL in case of error.
+ */
+static char *journal_path(char const *image_path) {
+    char const suffix[] = ".journal";
+    size_t length = strlen(image_path) + sizeof(suffix);
+    char *path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s%s", image_path, suffix);
+    }
+
+    return path;
+}
+
+/**
+ * Delete the journal file of an image, if there's one, so that its batches are
+ * never applied to the image.
+ *
+ * Input:
+ *   - image_path: path name of the image file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal file exists but can't be deleted.
+ *   - malloc failure.
+ */
+int journal_discard(char const *image_path) {
+    char *path = journal_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int ret = unlink(path);
+    free(path);
+    if (ret == -1 && errno != ENOENT) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Apply the batches in the journal file of an image to that image.
+ *
+ * Batches are applied in order, stopping at the first one that is incomplete
+ * or corrupted (which was being written when the FS stopped).
+ *
+ * Input:
+ *   - image_path: path name of the image file
+ *   - image: start of the (mapped) image
+ *   - image_size: size of the image
+ *
+ * Returns the number of batches applied, or -1 in case of error.
+ *
+ * Possible errors:
+ *   - The journal file exists but can't be read.
+ *   - malloc failure.
+ */
+int journal_replay(char const *image_path, char *image, size_t image_size) {
+    char *path = journal_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1; // no journal, nothing to replay
+    }
+
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)stat_buffer.st_size;
+    char *journal = malloc(size > 0 ? size : 1);
+    if (journal == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    size_t loaded = 0;
+    while (loaded < size) {
+        ssize_t ret = pread(fd, journal + loaded, size - loaded, (off_t)loaded);
+        if (ret <= 0) {
+            break; // only what was read is replayed
+        }
+        loaded += (size_t)ret;
+    }
+    close(fd);
+
+    int applied = 0;
+    uint64_t seq = 0;
+    size_t offset = 0;
+    while (loaded - offset >= sizeof(journal_batch_t)) {
+        journal_batch_t batch;
+        memcpy(&batch, journal + offset, sizeof(batch));
+        offset += sizeof(batch);
+
+        if (batch.magic != JOURNAL_MAGIC ||
+            (applied > 0 && batch.seq != seq + 1) ||
+            batch.length > loaded - offset ||
+            batch.checksum !=
+                journal_checksum(journal + offset, batch.length)) {
+            break; // torn or stale batch
+        }
+
+        char const *records = journal + offset;
+        size_t position = 0;
+        while (batch.length - position >= sizeof(journal_record_t)) {
+            journal_record_t record;
+            memcpy(&record, records + position, sizeof(record));
+            position += sizeof(record);
+
+            if (record.length > batch.length - position ||
+                record.offset > image_size ||
+                record.length > image_size - record.offset) {
+                break; // can't happen with a matching checksum
+            }
+
+            memcpy(image + record.offset, records + position, record.length);
+            position += record.length;
+        }
+
+        offset += batch.length;
+        seq = batch.seq;
+        applied++;
+    }
+
+    free(journal);
+    return applied;
+}
+
+/**
+ * Write a batch of records to the journal file, and sync it.
+ *
+ * Input:
+ *   - records: start of the records
+ *   - length: length of the records
+ *   - seq: number of the batch
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_write(char const *records, size_t length, uint64_t seq) {
+    journal_batch_t batch = {
+        .magic = JOURNAL_MAGIC,
+        .seq = seq,
+        .length = length,
+        .checksum = journal_checksum(records, length),
+    };
+
+    if (pwrite(journal_fd, &batch, sizeof(batch), (off_t)journal_file_size) !=
+            sizeof(batch) ||
+        pwrite(journal_fd, records, length,
+               (off_t)(journal_file_size + sizeof(batch))) != length) {
+        return -1;
+    }
+    journal_file_size += sizeof(batch) + length;
+
+    // a single sync commits every operation in the batch
+    return fdatasync(journal_fd);
+}
+
+/**
+ * Sync the image and empty the journal, whose batches are no longer needed.
+ *
+ * Must only be called by the flusher (or once it stopped).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_checkpoint(void) {
+    if (journal_sync_image() == -1 || ftruncate(journal_fd, 0) == -1 ||
+        fdatasync(journal_fd) == -1) {
+        return -1;
+    }
+    journal_file_size = 0;
+
+    return 0;
+}
+
+/**
+ * Flusher thread: every flush interval (or sooner, if the active buffer is
+ * half full or a sync was requested) writes the active buffer as one batch.
+ * With a flush interval of 0, it only does so when it's woken up.
+ */
+static void *journal_flusher(void *arg) {
+    (void)arg;
+
+    mutex_lock(&journal_lock);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(journal_flush_interval_ms / 1000);
+        deadline.tv_nsec += (long)(journal_flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (!journal_stopping && !journal_flush_requested &&
+               journal_active_size < JOURNAL_BUFFER_SIZE / 2) {
+            if (journal_flush_interval_ms == 0) {
+                cond_wait(&journal_flush_cond, &journal_lock);
+            } else if (pthread_cond_timedwait(&journal_flush_cond,
+                                              &journal_lock,
+                                              &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        journal_flush_requested = false;
+
+        if (journal_active_size == 0) {
+            if (journal_stopping) {
+                break;
+            }
+            continue; // nothing to commit
+        }
+
+        // Swaps the buffers, so that records keep being appended while the
+        // batch is written
+        char *records = journal_active;
+        size_t length = journal_active_size;
+        uint64_t seq = journal_seq++;
+        journal_active = records == journal_buffers[0] ? journal_buffers[1]
+                                                       : journal_buffers[0];
+        journal_active_size = 0;
+        mutex_unlock(&journal_lock);
+
+        if (journal_write(records, length, seq) == -1) {
+            PANIC("journal_flusher: couldn't write the journal")
+        }
+
+        mutex_lock(&journal_lock);
+        journal_flushed_seq = seq;
+        cond_broadcast(&journal_flushed_cond);
+        mutex_unlock(&journal_lock);
+
+        if (journal_file_size > JOURNAL_MAX_SIZE &&
+            journal_checkpoint() == -1) {
+            PANIC("journal_flusher: couldn't checkpoint the journal")
+        }
+
+        mutex_lock(&journal_lock);
+    }
+    mutex_unlock(&journal_lock);
+
+    return NULL;
+}
+
+/**
+ * Start journaling the updates to an image, in the (emptied) journal file
+ * kept next to it.
+ *
+ * Must only be called once the image reflects every batch in the journal file
+ * and is synced.
+ *
+ * Input:
+ *   - image_path: path name of the image file
+ *   - image: start of the (mapped) image
+ *   - image_size: size of the image
+ *   - flush_interval_ms: maximum time a logged update waits to be committed
+ *     (if 0, updates wait for a sync, or for the buffer to fill up)
+ *   - sync_image: writes every update made so far back to the image file and
+ *     syncs it (called before emptying the journal)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal file can't be created.
+ *   - malloc failure.
+ */
+int journal_init(char const *image_path, char *image, size_t image_size,
+                 size_t flush_interval_ms, int (*sync_image)(void)) {
+    char *path = journal_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+
+    journal_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0640);
+    free(path);
+    if (journal_fd == -1) {
+        return -1;
+    }
+
+    journal_buffers[0] = malloc(JOURNAL_BUFFER_SIZE);
+    journal_buffers[1] = malloc(JOURNAL_BUFFER_SIZE);
+    if (journal_buffers[0] == NULL || journal_buffers[1] == NULL) {
+        free(journal_buffers[0]);
+        free(journal_buffers[1]);
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+
+    journal_image = image;
+    journal_image_size = image_size;
+    journal_flush_interval_ms = flush_interval_ms;
+    journal_sync_image = sync_image;
+    journal_active = journal_buffers[0];
+    journal_active_size = 0;
+    journal_seq = 1;
+    journal_flushed_seq = 0;
+    journal_flush_requested = false;
+    journal_stopping = false;
+    journal_file_size = 0;
+
+    mutex_init(&journal_lock);
+    cond_init(&journal_flush_cond);
+    cond_init(&journal_flushed_cond);
+
+    if (pthread_create(&journal_flusher_tid, NULL, journal_flusher, NULL) !=
+        0) {
+        PANIC("journal_init: couldn't create the flusher thread")
+    }
+
+    return 0;
+}
+
+/**
+ * Stop journaling, committing the pending updates and emptying the journal
+ * (the image is synced).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_destroy(void) {
+    if (journal_fd == -1) {
+        return 0; // not journaled
+    }
+
+    mutex_lock(&journal_lock);
+    journal_stopping = true;
+    cond_signal(&journal_flush_cond);
+    mutex_unlock(&journal_lock);
+    pthread_join(journal_flusher_tid, NULL);
+
+    int ret = journal_checkpoint();
+
+    mutex_destroy(&journal_lock);
+    cond_destroy(&journal_flush_cond);
+    cond_destroy(&journal_flushed_cond);
+
+    free(journal_buffers[0]);
+    free(journal_buffers[1]);
+    journal_buffers[0] = NULL;
+    journal_buffers[1] = NULL;
+    close(journal_fd);
+    journal_fd = -1;
+
+    return ret;
+}
+
+/**
+ * Log an update to a range of the image, which will be committed with the next
+ * batch.
+ *
+ * Must be called after updating the range, while still holding the lock that
+ * protects it, so that its records are logged in the order of the updates.
+ *
+ * Input:
+ *   - addr: start of the range (in the image)
+ *   - len: length of the range
+ */
+void journal_log(void const *addr, size_t len) {
+    journal_log_at((size_t)((char const *)addr - journal_image), addr, len);
+}
+
+/**
+ * Log an update to a range of the image that's kept elsewhere in memory (see
+ * journal_log).
+ *
+ * Input:
+ *   - offset: start of the range in the image
+ *   - addr: new contents of the range
+ *   - len: length of the range
+ */
+void journal_log_at(size_t offset, void const *addr, size_t len) {
+    if (journal_fd == -1) {
+        return; // not journaled
+    }
+
+    size_t record_size = sizeof(journal_record_t) + len;
+    ALWAYS_ASSERT(record_size <= JOURNAL_BUFFER_SIZE,
+                  "journal_log: record larger than the journal buffer");
+
+    journal_record_t record = {
+        .offset = (uint64_t)offset,
+        .length = len,
+    };
+    ALWAYS_ASSERT(record.offset + len <= journal_image_size,
+                  "journal_log: range outside of the image");
+
+    mutex_lock(&journal_lock);
+    while (JOURNAL_BUFFER_SIZE - journal_active_size < record_size) {
+        // Waits for the flusher to free the buffer
+        journal_flush_requested = true;
+        cond_signal(&journal_flush_cond);
+        cond_wait(&journal_flushed_cond, &journal_lock);
+    }
+
+    memcpy(journal_active + journal_active_size, &record, sizeof(record));
+    memcpy(journal_active + journal_active_size + sizeof(record), addr, len);
+    journal_active_size += record_size;
+
+    if (journal_active_size >= JOURNAL_BUFFER_SIZE / 2) {
+        cond_signal(&journal_flush_cond);
+    }
+    mutex_unlock(&journal_lock);
+}
+
+/**
+ * Wait for every update logged so far to be committed.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_sync(void) {
+    if (journal_fd == -1) {
+        return 0; // not journaled
+    }
+
+    mutex_lock(&journal_lock);
+    // the batch being written (if any) is journal_seq - 1
+    uint64_t target = journal_seq - (journal_active_size == 0 ? 1 : 0);
+    while (journal_flushed_seq < target) {
+        journal_flush_requested = true;
+        cond_signal(&journal_flush_cond);
+        cond_wait(&journal_flushed_cond, &journal_lock);
+    }
+    mutex_unlock(&journal_lock);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+int journal_discard(char const *image_path);
+int journal_replay(char const *image_path, char *image, size_t image_size);
+int journal_init(char const *image_path, char *image, size_t image_size,
+                 size_t flush_interval_ms, int (*sync_image)(void));
+int journal_destroy(void);
+
+void journal_log(void const *addr, size_t len);
+void journal_log_at(size_t offset, void const *addr, size_t len);
+int journal_sync(void);
+
+#endif // JOURNAL_H
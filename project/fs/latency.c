@@ -0,0 +1,231 @@
+#include "latency.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Storage latency model, emulating the latency of each access to the FS state
+ * as if it was really stored in secondary memory.
+ */
+static tfs_latency_model_t latency_model;
+static size_t latency_spins;
+static uint64_t latency_table[TFS_ACCESS_CLASSES]; // in ns
+
+// Statistics
+static atomic_uint_fast64_t latency_accesses[TFS_ACCESS_CLASSES];
+static atomic_uint_fast64_t latency_total_ns[TFS_ACCESS_CLASSES];
+static atomic_uint_fast64_t latency_op_accesses[TFS_OPS];
+static atomic_uint_fast64_t latency_op_total_ns[TFS_OPS];
+
+// Operation the calling thread is in, to which its accesses are attributed
+static _Thread_local tfs_op_t latency_current_op = TFS_OP_OTHER;
+
+static char const *const access_class_names[TFS_ACCESS_CLASSES] = {
+    [TFS_ACCESS_INODE] = "inode",   [TFS_ACCESS_INODE_TABLE] = "inode_table",
+    [TFS_ACCESS_DIR] = "dir",       [TFS_ACCESS_BITMAP] = "bitmap",
+    [TFS_ACCESS_BLOCK] = "block",
+};
+
+/**
+ * Read the latency of each access class from a latency table file.
+ *
+ * Each line holds an access class name and its latency in nanoseconds
+ * (e.g. "block 20000"); empty lines and lines starting with '#' are ignored.
+ *
+ * Input:
+ *   - path: path name of the file (in the OS' file system)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file can't be opened.
+ *   - A line isn't a known access class followed by a latency.
+ */
+static int latency_table_load(char const *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[32];
+        unsigned long long latency_ns;
+        char extra;
+
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        if (sscanf(line, "%31s %llu %c", name, &latency_ns, &extra) != 2) {
+            fclose(file);
+            return -1; // malformed line
+        }
+
+        size_t i = 0;
+        while (i < TFS_ACCESS_CLASSES && strcmp(name, access_class_names[i])) {
+            i++;
+        }
+        if (i == TFS_ACCESS_CLASSES) {
+            fclose(file);
+            return -1; // unknown access class
+        }
+        latency_table[i] = latency_ns;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Initialize the storage latency model.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - Unknown latency model.
+ *   - The latency table file can't be read.
+ */
+int latency_init(tfs_params const *params) {
+    latency_model = params->latency_model;
+    latency_spins = params->latency_spins;
+
+    for (size_t i = 0; i < TFS_ACCESS_CLASSES; i++) {
+        latency_table[i] = 0;
+        atomic_store(&latency_accesses[i], 0);
+        atomic_store(&latency_total_ns[i], 0);
+    }
+    for (size_t i = 0; i < TFS_OPS; i++) {
+        atomic_store(&latency_op_accesses[i], 0);
+        atomic_store(&latency_op_total_ns[i], 0);
+    }
+
+    switch (latency_model) {
+    case TFS_LATENCY_NONE:
+    case TFS_LATENCY_SPIN:
+        return 0;
+    case TFS_LATENCY_SLEEP:
+        // every access class has the same latency
+        for (size_t i = 0; i < TFS_ACCESS_CLASSES; i++) {
+            latency_table[i] = params->latency_ns;
+        }
+        return 0;
+    case TFS_LATENCY_TABLE:
+        if (params->latency_table_path == NULL) {
+            return -1;
+        }
+        return latency_table_load(params->latency_table_path);
+    default:
+        return -1; // unknown latency model
+    }
+}
+
+/**
+ * Obtain the storage latency statistics.
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ */
+void latency_stats(tfs_latency_stats_t *stats) {
+    for (size_t i = 0; i < TFS_ACCESS_CLASSES; i++) {
+        stats->accesses[i] = atomic_load(&latency_accesses[i]);
+        stats->latency_ns[i] = atomic_load(&latency_total_ns[i]);
+    }
+    for (size_t i = 0; i < TFS_OPS; i++) {
+        stats->op_accesses[i] = atomic_load(&latency_op_accesses[i]);
+        stats->op_latency_ns[i] = atomic_load(&latency_op_total_ns[i]);
+    }
+}
+
+/**
+ * Start an operation in the calling thread: its next accesses to the FS state
+ * are attributed to the operation's class, until it starts another one.
+ *
+ * Input:
+ *   - op: class of the operation
+ */
+void latency_op(tfs_op_t op) { latency_current_op = op; }
+
+/**
+ * Do nothing, while preventing the compiler from performing any optimizations.
+ *
+ * We need to defeat the optimizer for the insert_delay() function.
+ * Under optimization, the empty loop would be completely optimized away.
+ * This function tells the compiler that the assembly code being run (which is
+ * none) might potentially change *all memory in the process*.
+ *
+ * This prevents the optimizer from optimizing this code away, because it does
+ * not know what it does and it may have side effects.
+ *
+ * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ *
+ * Exercise: try removing this function and look at the assembly generated to
+ * compare.
+ */
+static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+
+static uint64_t elapsed_ns(struct timespec const *start,
+                           struct timespec const *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000u +
+           (uint64_t)end->tv_nsec - (uint64_t)start->tv_nsec;
+}
+
+/**
+ * Artifically delay execution, according to the storage latency model.
+ *
+ * Auxiliary function to insert a delay.
+ * Used in accesses to persistent FS state as a way of emulating access
+ * latencies as if such data structures were really stored in secondary memory.
+ *
+ * Input:
+ *   - access_class: class of the access being emulated
+ */
+void insert_delay(tfs_access_class_t access_class) {
+    tfs_op_t op = latency_current_op;
+    atomic_fetch_add_explicit(&latency_accesses[access_class], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency_op_accesses[op], 1,
+                              memory_order_relaxed);
+
+    uint64_t latency_ns = 0;
+    switch (latency_model) {
+    case TFS_LATENCY_NONE:
+        break;
+    case TFS_LATENCY_SPIN: {
+        // busy loop, whose latency is only known by measuring it
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < latency_spins; i++) {
+            touch_all_memory();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency_ns = elapsed_ns(&start, &end);
+    } break;
+    case TFS_LATENCY_SLEEP:
+    case TFS_LATENCY_TABLE: {
+        // sleeping leaves the CPU to other threads, as a device would
+        latency_ns = latency_table[access_class];
+        struct timespec delay = {
+            .tv_sec = (time_t)(latency_ns / 1000000000u),
+            .tv_nsec = (long)(latency_ns % 1000000000u),
+        };
+        while (latency_ns > 0 && nanosleep(&delay, &delay) == -1 &&
+               errno == EINTR) {
+        }
+    } break;
+    default:
+        PANIC("insert_delay: unknown latency model");
+    }
+
+    atomic_fetch_add_explicit(&latency_total_ns[access_class], latency_ns,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency_op_total_ns[op], latency_ns,
+                              memory_order_relaxed);
+}
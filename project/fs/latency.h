@@ -0,0 +1,12 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "operations.h"
+
+int latency_init(tfs_params const *params);
+void latency_stats(tfs_latency_stats_t *stats);
+void latency_op(tfs_op_t op);
+
+void insert_delay(tfs_access_class_t access_class);
+
+#endif // LATENCY_H
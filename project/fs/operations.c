@@ -1,16 +1,22 @@
 #include "operations.h"
 #include "betterassert.h"
+#include "cache.h"
 #include "config.h"
+#include "journal.h"
+#include "latency.h"
 #include "locks.h"
 #include "state.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /**
@@ -22,27 +28,14 @@
 static pthread_mutex_t tfs_open_lock;
 
 /*
- * free_open_file_entries_lock
- *
- * Description - A pointer to the free open file entries table lock, located
- * in state.c
- */
-static pthread_mutex_t *free_open_file_entries_lock;
-
-/*
- * free_blocks_lock
- *
- * Description - A pointer to the free blocks table lock, located
- * in state.c
- */
-static pthread_mutex_t *free_blocks_lock;
-
-/*
- * inode_locks
+ * inode_syncs
  *
  * Description - A pointer to the table of inode locks located in state.c
  */
-static pthread_rwlock_t *inode_locks;
+static inode_sync_t *inode_syncs;
+
+static size_t inode_readv_at(inode_t const *inode, struct iovec const *iov,
+                             int iovcnt, size_t offset);
 
 tfs_params tfs_default_params() {
     tfs_params params = {
@@ -50,11 +43,20 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .image_path = NULL,
+        .journal_flush_interval_ms = 10,
+        .block_cache_size = 0,
+        .arena_mode = TFS_ARENA_LAZY,
+        .latency_model = TFS_LATENCY_SPIN,
+        .latency_spins = DELAY,
+        .latency_ns = 0,
+        .latency_table_path = NULL,
     };
     return params;
 }
 
 int tfs_init(tfs_params const *params_ptr) {
+    latency_op(TFS_OP_OTHER);
     tfs_params params;
     if (params_ptr != NULL) {
         params = *params_ptr;
@@ -67,20 +69,13 @@ int tfs_init(tfs_params const *params_ptr) {
     }
 
     mutex_init(&tfs_open_lock);
-    free_open_file_entries_lock = get_free_open_file_entries_lock();
-    free_blocks_lock = get_free_blocks_lock();
-    inode_locks = get_inode_locks();
-
-    // create root inode
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
-        return -1;
-    }
+    inode_syncs = get_inode_syncs();
 
     return 0;
 }
 
 int tfs_destroy() {
+    latency_op(TFS_OP_OTHER);
     if (state_destroy() != 0) {
         return -1;
     }
@@ -90,6 +85,35 @@ int tfs_destroy() {
     return 0;
 }
 
+int tfs_sync() { return journal_sync(); }
+
+int tfs_latency_stats(tfs_latency_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+
+    latency_stats(stats);
+    return 0;
+}
+
+int tfs_snapshot(char const *path) {
+    latency_op(TFS_OP_SNAPSHOT);
+    if (path == NULL) {
+        return -1;
+    }
+
+    return state_snapshot(path);
+}
+
+int tfs_cache_stats(tfs_cache_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+
+    block_cache_stats(stats);
+    return 0;
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
@@ -106,7 +130,7 @@ static bool valid_pathname(char const *name) {
  * Returns the inumber of the file, -1 if unsuccessful.
  */
 static int tfs_lookup(char const *name, inode_t const *root_inode) {
-    ALWAYS_ASSERT(root_inode->i_data_block == 0,
+    ALWAYS_ASSERT(root_inode->i_direct_blocks[0] == 0,
                   "tfs_lookup: the given root_inode does not correspond to the "
                   "root inode");
     if (!valid_pathname(name)) {
@@ -119,49 +143,159 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
     return find_in_dir(root_inode, name);
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
+/**
+ * Drop a reference to a file (held by an open file handle or a lease), and
+ * delete the file if it was unlinked and this was the last one.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - changing: whether the caller is within state_change_begin/end already
+ */
+static void file_put(int inumber, bool changing) {
+    if (!inode_ref_put(inumber)) {
+        return;
+    }
+
+    // Operations that got to the inode through a handle just closed may still
+    // hold its lock, but no new ones can
+    rwl_wrlock(&inode_syncs[inumber].lock);
+    rwl_unlock(&inode_syncs[inumber].lock);
+
+    if (!changing) {
+        state_change_begin();
+    }
+    inode_delete(inumber);
+    if (!changing) {
+        state_change_end();
+    }
+}
+
+/**
+ * Follow the chain of symlinks starting at a file, without letting go of the
+ * root directory in between, and cache where it ends.
+ * Must be called with the root directory's lock held.
+ *
+ * Input:
+ *   - root_inode: the root directory inode
+ *   - inumber: the file's inumber
+ *   - target: where to store the target of the last symlink of the chain, if
+ *     it doesn't exist
+ *
+ * Returns the inumber of the first file of the chain that isn't a symlink (or
+ * is one whose target isn't written yet), -1 if the chain ends at a file that
+ * doesn't exist, or -2 if the chain is invalid, or loops, or is longer than
+ * SYMLINK_MAX_DEPTH.
+ */
+static int symlink_resolve(inode_t const *root_inode, int inumber,
+                           char target[static MAX_FILE_NAME + 2]) {
+    // (a file's type never changes while it can be looked up)
+    if (inode_get(inumber)->i_node_type != T_SYM_LINK) {
+        return inumber;
+    }
+
+    unsigned generation;
+    int cached = symlink_cache_get(inumber, &generation);
+    if (cached != -1) {
+        return cached;
+    }
+
+    int symlink_inumber = inumber;
+    for (size_t depth = 0;; depth++) {
+        inode_t const *inode = inode_get(inumber);
+        if (inode->i_node_type != T_SYM_LINK) {
+            break;
+        }
+
+        rwl_rdlock(&inode_syncs[inumber].lock);
+        size_t size = inode->i_size;
+        if (size == 0) {
+            rwl_unlock(&inode_syncs[inumber].lock);
+            break; // opened as is, for its target to be written
+        }
+        if (depth == SYMLINK_MAX_DEPTH || size > MAX_FILE_NAME + 1) {
+            rwl_unlock(&inode_syncs[inumber].lock);
+            return -2; // too many symlinks, or a target no file can have
+        }
+
+        struct iovec iov = {.iov_base = target, .iov_len = size};
+        inode_readv_at(inode, &iov, 1, 0);
+        rwl_unlock(&inode_syncs[inumber].lock);
+        target[size] = '\0';
+
+        if (!valid_pathname(target)) {
+            return -2;
+        }
+        inumber = tfs_lookup(target, root_inode);
+        if (inumber == -1) {
+            return -1; // dangling (only the last symlink's target is kept)
+        }
+    }
+
+    symlink_cache_set(symlink_inumber, inumber, generation);
+    return inumber;
+}
+
+/**
+ * Open a file (see tfs_open).
+ * Must be called within state_change_begin/end if the file may be created or
+ * truncated.
+ */
+static int file_open(char const *name, tfs_file_mode_t mode) {
     // Checks if the path name is valid
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // Lock tfs_open to not allow 2 files with the same name to be created
-    mutex_lock(&tfs_open_lock);
+    // Only creating a file changes the root directory, so opens of existing
+    // files share the root's lock
+    bool create = mode & TFS_O_CREAT;
+    if (create) {
+        // Lock tfs_open to not allow 2 files with the same name to be created
+        mutex_lock(&tfs_open_lock);
+        rwl_wrlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    } else {
+        rwl_rdlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    }
 
-    rwl_wrlock(&inode_locks[ROOT_DIR_INUM]);
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_open: root dir inode must exist");
     int inum = tfs_lookup(name, root_dir_inode);
     size_t offset;
 
+    // If the file is an initialized symlink, open its target instead, which
+    // is created if it doesn't exist (and that's requested)
+    char target[MAX_FILE_NAME + 2];
     if (inum >= 0) {
-        // The file already exists
-        rwl_wrlock(&inode_locks[inum]);
-        mutex_unlock(&tfs_open_lock);
+        inum = symlink_resolve(root_dir_inode, inum, target);
+        if (inum == -1) {
+            name = target;
+        } else if (inum == -2) {
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+            if (create) {
+                mutex_unlock(&tfs_open_lock);
+            }
+            return -1;
+        }
+    }
+
+    if (inum >= 0) {
+        // The file already exists; it's only changed if it's truncated
+        if (mode & TFS_O_TRUNC) {
+            rwl_wrlock(&inode_syncs[inum].lock);
+        } else {
+            rwl_rdlock(&inode_syncs[inum].lock);
+        }
+        if (create) {
+            mutex_unlock(&tfs_open_lock);
+        }
         inode_t *inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
 
-        // if the file is an initialized symlink, open its target
-        if (inode->i_node_type == T_SYM_LINK && inode->i_size > 0) {
-            void *data = data_block_get(inode->i_data_block);
-            ALWAYS_ASSERT(data != NULL,
-                          "tfs_open: symlink must have a data block");
-            char buffer[inode->i_size];
-            memcpy(buffer, data, inode->i_size);
-
-            rwl_unlock(&inode_locks[inum]);
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-            return tfs_open(buffer, mode);
-        }
-
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            inode_truncate(inode);
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
@@ -169,82 +303,113 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         } else {
             offset = 0;
         }
-        rwl_unlock(&inode_locks[inum]);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        // (the file can't be unlinked before it's referenced, as the root
+        // directory is locked)
+        inode_ref_get(inum);
+        rwl_unlock(&inode_syncs[inum].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
             mutex_unlock(&tfs_open_lock);
             return -1; // no space in inode table
         }
 
         // Add entry in the root directory
         if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
             mutex_unlock(&tfs_open_lock);
             inode_delete(inum);
             return -1; // no space in directory
         }
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        inode_ref_get(inum);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         mutex_unlock(&tfs_open_lock);
 
         offset = 0;
     } else {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-        mutex_unlock(&tfs_open_lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
     // handle
-    return add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(inum, offset);
+    if (fhandle == -1) {
+        // (the file may have been unlinked meanwhile)
+        file_put(inum, mode & (TFS_O_CREAT | TFS_O_TRUNC));
+    }
+
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
     // opened but it remains created
 }
 
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    latency_op(TFS_OP_OPEN);
+    // Only creating or truncating a file changes the FS
+    bool change = mode & (TFS_O_CREAT | TFS_O_TRUNC);
+    if (change) {
+        state_change_begin();
+    }
+    int fhandle = file_open(name, mode);
+    if (change) {
+        state_change_end();
+    }
+
+    return fhandle;
+}
+
 int tfs_sym_link(char const *target, char const *link_name) {
-    rwl_wrlock(&inode_locks[ROOT_DIR_INUM]);
+    latency_op(TFS_OP_LINK);
+    state_change_begin();
+    rwl_wrlock(&inode_syncs[ROOT_DIR_INUM].lock);
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_sym_link: root dir inode must exist");
 
     if (tfs_lookup(link_name, root_dir_inode) != -1) {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // there's already a file in root with link_name
     }
 
     int link_inumber;
     if ((link_inumber = inode_create(T_SYM_LINK)) == -1) {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // no free slots in inode table for the link inode
     }
 
-    rwl_rdlock(&inode_locks[link_inumber]);
+    rwl_rdlock(&inode_syncs[link_inumber].lock);
     inode_t *link_inode = inode_get(link_inumber);
     ALWAYS_ASSERT(link_inode != NULL, "tfs_sym_link: link inode doesn't exist");
 
     // add the soft link to the directory entry
     if (add_dir_entry(root_dir_inode, link_name + 1, link_inumber) == -1) {
-        rwl_unlock(&inode_locks[link_inumber]);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[link_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         inode_delete(link_inumber);
+        state_change_end();
         return -1; // link filename not valid or root directory full of entries
     }
 
-    rwl_unlock(&inode_locks[link_inumber]);
-    rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+    rwl_unlock(&inode_syncs[link_inumber].lock);
+    rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    state_change_end();
     // open symlink file so that we can write the target path in the data block
     int symlink_handle;
     if ((symlink_handle = tfs_open(link_name, 0)) == -1)
         return -1; // couldn't open file
 
-    // write the target path in the sym link data block
-    if (tfs_write(symlink_handle, target, sizeof(target)) < sizeof(target)) {
+    // write the target path (with its '\0') as the sym link's data
+    size_t target_len = strlen(target) + 1;
+    if (tfs_write(symlink_handle, target, target_len) < (ssize_t)target_len) {
         // couldn't write the target path, which results in a broken symlink,
         // so we will delete it
         tfs_close(symlink_handle);
@@ -258,166 +423,717 @@ int tfs_sym_link(char const *target, char const *link_name) {
 }
 
 int tfs_link(char const *target, char const *link_name) {
-    rwl_wrlock(&inode_locks[ROOT_DIR_INUM]);
+    latency_op(TFS_OP_LINK);
+    state_change_begin();
+    rwl_wrlock(&inode_syncs[ROOT_DIR_INUM].lock);
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_link: root dir inode must exist");
 
     int inumber;
     if ((inumber = tfs_lookup(target, root_dir_inode)) == -1) {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // target doesn't exist
     }
 
     if (tfs_lookup(link_name, root_dir_inode) != -1) {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // there's already a file in root with link_name
     }
 
-    rwl_wrlock(&inode_locks[inumber]);
+    rwl_wrlock(&inode_syncs[inumber].lock);
 
     inode_t *target_inode = inode_get(inumber);
     ALWAYS_ASSERT(target_inode != NULL, "tfs_link: target inode doesn't exist");
     if (target_inode->i_node_type == T_SYM_LINK) {
-        rwl_unlock(&inode_locks[inumber]);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // not allowed
     }
 
     // add the hard link to the directory entry
     if (add_dir_entry(root_dir_inode, link_name + 1, inumber) == -1) {
-        rwl_unlock(&inode_locks[inumber]);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
         return -1; // link filename not valid or root directory full of entries
     }
 
-    target_inode->hard_links++; // increment hard_links number
-    rwl_unlock(&inode_locks[inumber]);
-    rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+    inode_links_set(target_inode, target_inode->hard_links + 1);
+    inode_journal(target_inode);
+    rwl_unlock(&inode_syncs[inumber].lock);
+    rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    state_change_end();
+    return 0;
+}
+
+int tfs_clone(char const *source, char const *dest) {
+    latency_op(TFS_OP_CLONE);
+    state_change_begin();
+    rwl_wrlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_clone: root dir inode must exist");
+
+    int source_inumber = tfs_lookup(source, root_dir_inode);
+    if (source_inumber == -1) {
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
+        return -1; // source doesn't exist
+    }
+
+    if (tfs_lookup(dest, root_dir_inode) != -1) {
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
+        return -1; // there's already a file in root with dest
+    }
+
+    rwl_rdlock(&inode_syncs[source_inumber].lock);
+    inode_t const *source_inode = inode_get(source_inumber);
+    ALWAYS_ASSERT(source_inode != NULL,
+                  "tfs_clone: source inode doesn't exist");
+    if (source_inode->i_node_type != T_FILE) {
+        rwl_unlock(&inode_syncs[source_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
+        return -1; // only regular files are cloned
+    }
+
+    int dest_inumber = inode_create(T_FILE);
+    if (dest_inumber == -1) {
+        rwl_unlock(&inode_syncs[source_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        state_change_end();
+        return -1; // no free slots in inode table
+    }
+
+    // The clone isn't reachable yet, so it needn't be locked
+    inode_clone(inode_get(dest_inumber), source_inode);
+    rwl_unlock(&inode_syncs[source_inumber].lock);
+
+    if (add_dir_entry(root_dir_inode, dest + 1, dest_inumber) == -1) {
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        inode_delete(dest_inumber);
+        state_change_end();
+        return -1; // dest not valid or root directory full of entries
+    }
+
+    rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    state_change_end();
     return 0;
 }
 
 int tfs_close(int fhandle) {
-    mutex_lock(free_open_file_entries_lock);
+    latency_op(TFS_OP_CLOSE);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        mutex_unlock(free_open_file_entries_lock);
         return -1; // invalid fd
     }
 
+    int inumber = file->of_inumber;
     remove_from_open_file_table(fhandle);
-    mutex_unlock(free_open_file_entries_lock);
+    mutex_unlock(&file->lock);
+
+    // The file is deleted here if it was unlinked while open
+    file_put(inumber, false);
 
     return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    mutex_lock(free_open_file_entries_lock);
+/**
+ * Find where the byte at some offset of a file is stored, and how many of the
+ * following bytes are stored right after it, in the same block.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - offset: offset of the byte in the file
+ *   - block_index: where to store the index of the block holding it
+ *   - block_offset: where to store its offset in that block
+ *
+ * Returns the number of bytes from the given one to the end of the block (or
+ * to the end of the ring, if the file is a ring that wraps around before).
+ */
+static size_t inode_data_locate(inode_t const *inode, size_t offset,
+                                size_t *block_index, size_t *block_offset) {
+    size_t block_size = state_block_size();
+    size_t contiguous = SIZE_MAX;
+    if (inode->i_ring_capacity > 0) {
+        offset %= inode->i_ring_capacity;
+        contiguous = inode->i_ring_capacity - offset;
+    }
+
+    *block_index = offset / block_size;
+    *block_offset = offset % block_size;
+    if (contiguous > block_size - *block_offset) {
+        contiguous = block_size - *block_offset;
+    }
+
+    return contiguous;
+}
+
+/**
+ * Write to an inline file (see inode_writev_at), which the whole write fits
+ * in.
+ *
+ * Returns the number of bytes that were written.
+ */
+static size_t inode_inline_writev_at(inode_t *inode, struct iovec const *iov,
+                                     int iovcnt, size_t offset) {
+    // The gap left by writing past the end of the file reads as zeros
+    if (offset > inode->i_size) {
+        memset(inode->i_inline_data + inode->i_size, 0,
+               offset - inode->i_size);
+    }
+
+    size_t written = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(inode->i_inline_data + offset + written, iov[i].iov_base,
+               iov[i].iov_len);
+        written += iov[i].iov_len;
+    }
+
+    if (written > 0) {
+        if (offset + written > inode->i_size) {
+            inode_size_set(inode, offset + written);
+        }
+        inode_journal(inode);
+    }
+
+    return written;
+}
+
+/**
+ * Write to a file, starting at the given offset.
+ * Must be called with the inode's lock held for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: buffers containing the contents to write, in order
+ *   - iovcnt: number of buffers
+ *   - offset: offset in the file where the write starts
+ *
+ * Returns the number of bytes that were written (can be lower than the length
+ * of the buffers if the maximum file size, or the capacity of a ring file, is
+ * exceeded or there's no space left).
+ */
+static size_t inode_writev_at(inode_t *inode, struct iovec const *iov,
+                              int iovcnt, size_t offset) {
+    // A ring file can't be written before its head (those bytes are gone) or
+    // past its end (the bytes in between would be stale), and only its
+    // capacity in bytes is written at once; its offsets grow past the maximum
+    // file size
+    size_t max_file_size = state_max_file_size();
+    size_t capacity = inode->i_ring_capacity;
+    if (capacity > 0) {
+        if (offset < inode->i_ring_head || offset > inode->i_size) {
+            return 0;
+        }
+        max_file_size = offset + capacity;
+        if (max_file_size < offset) {
+            max_file_size = SIZE_MAX; // the offsets overflowed
+        }
+    }
+
+    if (inode->i_inline) {
+        size_t end = offset;
+        for (int i = 0; i < iovcnt && end <= INODE_INLINE_SIZE; i++) {
+            end += iov[i].iov_len;
+        }
+
+        // The file stays inline if it still fits in its inode (and, if it's a
+        // ring file, doesn't wrap around yet)
+        if (end <= INODE_INLINE_SIZE && (capacity == 0 || end <= capacity)) {
+            return inode_inline_writev_at(inode, iov, iovcnt, offset);
+        } else if (inode_inline_promote(inode) == -1) {
+            return 0; // no space
+        }
+    }
+
+    size_t written = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        // Determine how many bytes to write from this buffer
+        size_t to_write = iov[i].iov_len;
+        if (offset >= max_file_size) {
+            break;
+        } else if (to_write > max_file_size - offset) {
+            to_write = max_file_size - offset;
+        }
+
+        char const *buffer = iov[i].iov_base;
+        size_t copied = 0;
+        while (copied < to_write) {
+            // Write block by block, allocating new blocks as needed
+            size_t block_index, block_offset;
+            size_t chunk =
+                inode_data_locate(inode, offset, &block_index, &block_offset);
+            if (chunk > to_write - copied) {
+                chunk = to_write - copied;
+            }
+
+            int bnum = inode_block_alloc(inode, block_index);
+            if (bnum == -1) {
+                break; // no space
+            }
+
+            void *block = data_block_edit(bnum);
+            ALWAYS_ASSERT(block != NULL,
+                          "inode_writev_at: data block deleted mid-write");
+
+            // Perform the actual write
+            memcpy(block + block_offset, buffer + copied, chunk);
+            data_block_edited(block);
+            data_block_put(block);
+            copied += chunk;
+
+            offset += chunk;
+        }
+
+        written += copied;
+        if (copied < iov[i].iov_len) {
+            break; // the file is full
+        }
+    }
+    if (written > 0) {
+        // The file only grows once all of it is written, so it's never seen
+        // with bytes that aren't there yet; a ring file loses the oldest bytes
+        // it has no room left for
+        if (capacity > 0 && offset > inode->i_size) {
+            size_t head = inode->i_ring_head;
+            if (offset - head > capacity) {
+                head = offset - capacity;
+            }
+            inode_extent_set(inode, head, offset);
+        } else if (offset > inode->i_size) {
+            inode_size_set(inode, offset);
+        }
+        // the new blocks were already logged, when allocated
+        inode_journal(inode);
+    }
+
+    return written;
+}
+
+/**
+ * Read from a file, starting at the given offset.
+ * Must be called with the inode's lock held.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: destination buffers, filled in order
+ *   - iovcnt: number of buffers
+ *   - offset: offset in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their length if the file size was reached).
+ */
+static size_t inode_readv_at(inode_t const *inode, struct iovec const *iov,
+                             int iovcnt, size_t offset) {
+    size_t copied = 0;
+
+    for (int i = 0; i < iovcnt && offset < inode->i_size; i++) {
+        // Determine how many bytes to read into this buffer
+        size_t to_read = inode->i_size - offset;
+        if (to_read > iov[i].iov_len) {
+            to_read = iov[i].iov_len;
+        }
+
+        char *buffer = iov[i].iov_base;
+        size_t filled = 0;
+        if (inode->i_inline) {
+            memcpy(buffer, inode->i_inline_data + offset, to_read);
+            filled = to_read;
+            offset += to_read;
+        }
+        while (filled < to_read) {
+            // Read block by block
+            size_t block_index, block_offset;
+            size_t chunk =
+                inode_data_locate(inode, offset, &block_index, &block_offset);
+            if (chunk > to_read - filled) {
+                chunk = to_read - filled;
+            }
+
+            int bnum = inode_block_get(inode, block_index);
+            if (bnum == -1) {
+                // Blocks that were never written read as zeros
+                memset(buffer + filled, 0, chunk);
+            } else {
+                void *block = data_block_get(bnum);
+                ALWAYS_ASSERT(block != NULL,
+                              "inode_readv_at: data block deleted mid-read");
+
+                // Perform the actual read
+                memcpy(buffer + filled, block + block_offset, chunk);
+                data_block_put(block);
+            }
+            filled += chunk;
+            offset += chunk;
+        }
+
+        copied += filled;
+    }
+
+    return copied;
+}
+
+/**
+ * Write to an open file, as a single operation.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: buffers containing the contents to write, in order
+ *   - iovcnt: number of buffers
+ *   - offset: offset in the file where the write starts, or NULL to write at
+ *     the file handle's current offset (and advance it)
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+static ssize_t open_file_writev(int fhandle, struct iovec const *iov,
+                                int iovcnt, size_t const *offset) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    // Resolving the handle locks its entry, but no global lock (writes only
+    // hold off snapshots)
+    state_change_begin();
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        mutex_unlock(free_open_file_entries_lock);
+        state_change_end();
         return -1;
     }
 
-    rwl_wrlock(&inode_locks[file->of_inumber]);
-    mutex_lock(&file->lock);
-    mutex_unlock(free_open_file_entries_lock);
+    int inumber = file->of_inumber;
+    rwl_wrlock(&inode_syncs[inumber].lock);
+    if (offset != NULL) {
+        // The shared offset isn't used, so the open file entry is let go as
+        // soon as the inode is locked
+        mutex_unlock(&file->lock);
+    }
 
     //  From the open file table entry, we get the inode
-    inode_t *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    size_t to_write = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        to_write += iov[i].iov_len;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            mutex_lock(free_blocks_lock);
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                mutex_unlock(free_blocks_lock);
-                mutex_unlock(&file->lock);
-                rwl_unlock(&inode_locks[file->of_inumber]);
-                return -1; // no space
-            }
-            mutex_unlock(free_blocks_lock);
-            inode->i_data_block = bnum;
-        }
+    size_t written;
+    if (offset != NULL) {
+        written = inode_writev_at(inode, iov, iovcnt, *offset);
+    } else {
+        written = inode_writev_at(inode, iov, iovcnt, file->of_offset);
+    }
+    if (inode->i_node_type == T_SYM_LINK) {
+        // (the symlink's target is being written)
+        namespace_changed();
+    }
+
+    if (offset != NULL) {
+        rwl_unlock(&inode_syncs[inumber].lock);
+    } else {
+        // The offset associated with the file handle is incremented
+        // accordingly
+        file->of_offset += written;
+        rwl_unlock(&inode_syncs[inumber].lock);
+        mutex_unlock(&file->lock);
+    }
+    state_change_end();
+
+    if (written == 0 && to_write > 0) {
+        return -1; // no space
+    }
+
+    return (ssize_t)written;
+}
+
+/**
+ * Read from an open file, as a single operation.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: destination buffers, filled in order
+ *   - iovcnt: number of buffers
+ *   - offset: offset in the file where the read starts, or NULL to read from
+ *     the file handle's current offset (and advance it)
+ *
+ * Returns the number of bytes that were read, or -1 in case of error.
+ */
+static ssize_t open_file_readv(int fhandle, struct iovec const *iov,
+                               int iovcnt, size_t const *offset) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    // Resolving the handle locks its entry, but no global lock
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+    int inumber = file->of_inumber;
+    rwl_rdlock(&inode_syncs[inumber].lock);
+    if (offset != NULL) {
+        // The shared offset isn't used, so the open file entry is let go as
+        // soon as the inode is locked, and many threads can read through the
+        // same handle at once
+        mutex_unlock(&file->lock);
+    }
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+    // From the open file table entry, we get the inode
+    inode_t const *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+    // the bytes before the head of a ring file are gone
+    if ((offset != NULL ? *offset : file->of_offset) < inode->i_ring_head) {
+        rwl_unlock(&inode_syncs[inumber].lock);
+        if (offset == NULL) {
+            mutex_unlock(&file->lock);
         }
+        return -1;
     }
-    mutex_unlock(&file->lock);
-    rwl_unlock(&inode_locks[file->of_inumber]);
 
-    return (ssize_t)to_write;
+    size_t copied;
+    if (offset != NULL) {
+        copied = inode_readv_at(inode, iov, iovcnt, *offset);
+        rwl_unlock(&inode_syncs[inumber].lock);
+    } else {
+        copied = inode_readv_at(inode, iov, iovcnt, file->of_offset);
+        // The offset associated with the file handle is incremented
+        // accordingly
+        file->of_offset += copied;
+        rwl_unlock(&inode_syncs[inumber].lock);
+        mutex_unlock(&file->lock);
+    }
+
+    return (ssize_t)copied;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    latency_op(TFS_OP_WRITE);
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return open_file_writev(fhandle, &iov, 1, NULL);
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    mutex_lock(free_open_file_entries_lock);
+    latency_op(TFS_OP_READ);
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return open_file_readv(fhandle, &iov, 1, NULL);
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    latency_op(TFS_OP_WRITE);
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return open_file_writev(fhandle, &iov, 1, &offset);
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    latency_op(TFS_OP_READ);
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return open_file_readv(fhandle, &iov, 1, &offset);
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    latency_op(TFS_OP_WRITE);
+    return open_file_writev(fhandle, iov, iovcnt, NULL);
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    latency_op(TFS_OP_READ);
+    return open_file_readv(fhandle, iov, iovcnt, NULL);
+}
+
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t offset) {
+    latency_op(TFS_OP_WRITE);
+    return open_file_writev(fhandle, iov, iovcnt, &offset);
+}
+
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt,
+                   size_t offset) {
+    latency_op(TFS_OP_READ);
+    return open_file_readv(fhandle, iov, iovcnt, &offset);
+}
+
+int tfs_read_lease(int fhandle, tfs_lease_t *lease, size_t len,
+                   size_t offset) {
+    latency_op(TFS_OP_LEASE);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        mutex_unlock(free_open_file_entries_lock);
         return -1;
     }
 
-    rwl_rdlock(&inode_locks[file->of_inumber]);
-    mutex_lock(&file->lock);
-    mutex_unlock(free_open_file_entries_lock);
+    // The shared offset isn't used, so the open file entry is let go as soon
+    // as the inode is locked
+    int inumber = file->of_inumber;
+    rwl_rdlock(&inode_syncs[inumber].lock);
+    mutex_unlock(&file->lock);
 
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    inode_t const *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read_lease: inode of open file deleted");
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    // the bytes before the head of a ring file are gone
+    if (offset < inode->i_ring_head) {
+        rwl_unlock(&inode_syncs[inumber].lock);
+        return -1;
+    }
+
+    // Determine how many bytes to lease, up to the end of the block
+    size_t block_index, block_offset;
+    size_t to_lease =
+        inode_data_locate(inode, offset, &block_index, &block_offset);
+    if (inode->i_size <= offset) {
+        to_lease = 0;
+    } else if (to_lease > inode->i_size - offset) {
+        to_lease = inode->i_size - offset;
+    }
+    if (to_lease > len) {
+        to_lease = len;
+    }
+
+    lease->data = NULL;
+    lease->block = -1;
+    if (to_lease > 0 && inode->i_inline) {
+        // (inline data is changed in place, and moved out when the file
+        // grows, so nothing is waited for)
+        memcpy(lease->inline_copy, inode->i_inline_data + offset, to_lease);
+        lease->data = lease->inline_copy;
+    } else if (to_lease > 0) {
+        int bnum = inode_block_get(inode, block_index);
+        // Blocks that were never written read as zeros
+        char const *block =
+            bnum == -1 ? data_block_zeros() : data_block_lease(bnum);
+        if (block == NULL) {
+            rwl_unlock(&inode_syncs[inumber].lock);
+            return -1; // no room for more leased blocks in the cache
+        }
+        lease->data = block + block_offset;
+        if (bnum != -1) {
+            // The block is shared with the lease, so it's neither changed nor
+            // freed (by this file or its clones) before the lease is released
+            data_block_ref(bnum);
+            lease->block = bnum;
+        }
     }
+    lease->len = to_lease;
+    lease->inumber = inumber;
+
+    // The inode can't be deleted before the lease is released
+    inode_lease_get(inumber);
+    rwl_unlock(&inode_syncs[inumber].lock);
+
+    return 0;
+}
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+int tfs_release_lease(tfs_lease_t *lease) {
+    latency_op(TFS_OP_LEASE);
+    if (lease->inumber == -1) {
+        return -1; // already released
+    }
+
+    // (the leased block stays in memory until then)
+    if (lease->data != NULL) {
+        data_block_lease_put(lease->data);
+    }
+    if (lease->block != -1 && data_block_unref(lease->block) == 0) {
+        // the file dropped the block meanwhile
+        state_change_begin();
+        data_block_free(lease->block);
+        state_change_end();
+    }
+    if (inode_lease_put(lease->inumber)) {
+        // it was unlinked, and closed, while leased
+        state_change_begin();
+        inode_delete(lease->inumber);
+        state_change_end();
+    }
+    lease->data = NULL;
+    lease->len = 0;
+    lease->inumber = -1;
+    lease->block = -1;
+
+    return 0;
+}
+
+ssize_t tfs_size(int fhandle) {
+    latency_op(TFS_OP_STAT);
+    tfs_stat_t stat;
+    if (tfs_stat(fhandle, &stat) == -1) {
+        return -1;
+    }
+
+    return (ssize_t)stat.size;
+}
+
+int tfs_stat(int fhandle, tfs_stat_t *stat) {
+    latency_op(TFS_OP_STAT);
+    // Neither the open file entry nor the inode are locked
+    int inumber = open_file_inumber(fhandle);
+    if (inumber == -1) {
+        return -1;
+    }
+
+    inode_stat(inumber, &stat->head, &stat->size, &stat->hard_links);
+
+    return 0;
+}
+
+int tfs_make_ring(int fhandle, size_t capacity) {
+    latency_op(TFS_OP_OTHER);
+    if (capacity == 0 || capacity > state_max_file_size()) {
+        return -1;
+    }
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+    state_change_begin();
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        state_change_end();
+        return -1;
     }
+
+    int inumber = file->of_inumber;
+    rwl_wrlock(&inode_syncs[inumber].lock);
     mutex_unlock(&file->lock);
-    rwl_unlock(&inode_locks[file->of_inumber]);
 
-    return (ssize_t)to_read;
+    inode_t *inode = inode_get(inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_make_ring: inode of open file deleted");
+
+    int ret = -1;
+    if (inode->i_node_type == T_FILE && inode->i_ring_capacity == 0 &&
+        inode->i_size == 0) {
+        inode->i_ring_capacity = capacity;
+        inode_journal(inode);
+        ret = 0;
+    }
+
+    rwl_unlock(&inode_syncs[inumber].lock);
+    state_change_end();
+    return ret;
 }
 
-int tfs_unlink(char const *target) {
-    rwl_wrlock(&inode_locks[ROOT_DIR_INUM]);
+/**
+ * Delete a link (see tfs_unlink).
+ * Must be called within state_change_begin/end.
+ */
+static int file_unlink(char const *target) {
+    rwl_wrlock(&inode_syncs[ROOT_DIR_INUM].lock);
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_unlink: root dir inode must exist");
 
     int target_inumber;
     if ((target_inumber = tfs_lookup(target, root_dir_inode)) == -1) {
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         return -1; // target doesn't exist
     }
 
-    mutex_lock(free_open_file_entries_lock);
-
-    rwl_wrlock(&inode_locks[target_inumber]);
+    rwl_wrlock(&inode_syncs[target_inumber].lock);
 
     inode_t *target_inode = inode_get(target_inumber);
     ALWAYS_ASSERT(target_inode != NULL,
@@ -427,109 +1143,288 @@ int tfs_unlink(char const *target) {
     case T_SYM_LINK:
         // remove its entry from the root directory
         if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-            rwl_unlock(&inode_locks[target_inumber]);
-            mutex_unlock(free_open_file_entries_lock);
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+            rwl_unlock(&inode_syncs[target_inumber].lock);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
             return -1; // target doesn't exist anymore
         }
 
-        rwl_unlock(&inode_locks[target_inumber]);
-        mutex_unlock(free_open_file_entries_lock);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-        // free the inode and the associated block
-        inode_delete(target_inumber);
+        rwl_unlock(&inode_syncs[target_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+        // free the inode and the associated block, unless it's still open
+        if (inode_unlinked(target_inumber)) {
+            inode_delete(target_inumber);
+        }
         break;
     case T_FILE: // hard link
         // remove its entry from the root directory
         if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-            rwl_unlock(&inode_locks[target_inumber]);
-            mutex_unlock(free_open_file_entries_lock);
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+            rwl_unlock(&inode_syncs[target_inumber].lock);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
             return -1; // target doesn't exist anymore
         }
 
-        if (target_inode->hard_links-- == 1) {
-            // free the inode and the associated block
-            rwl_unlock(&inode_locks[target_inumber]);
-            mutex_unlock(free_open_file_entries_lock);
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-            inode_delete(target_inumber);
+        inode_links_set(target_inode, target_inode->hard_links - 1);
+        if (target_inode->hard_links == 0) {
+            // Only the name is removed right away; the inode and its blocks
+            // are freed by whoever closes the file last, if it's still open
+            rwl_unlock(&inode_syncs[target_inumber].lock);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+            if (inode_unlinked(target_inumber)) {
+                inode_delete(target_inumber);
+            }
         } else {
-            rwl_unlock(&inode_locks[target_inumber]);
-            mutex_unlock(free_open_file_entries_lock);
-            rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+            inode_journal(target_inode);
+            rwl_unlock(&inode_syncs[target_inumber].lock);
+            rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         }
         break;
     case T_DIRECTORY:
         // deleting root is not allowed
-        rwl_unlock(&inode_locks[target_inumber]);
-        mutex_unlock(free_open_file_entries_lock);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[target_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         return -1;
         break;
     default:
-        rwl_unlock(&inode_locks[target_inumber]);
-        mutex_unlock(free_open_file_entries_lock);
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
+        rwl_unlock(&inode_syncs[target_inumber].lock);
+        rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
         break;
     }
 
     return 0;
 }
 
+int tfs_unlink(char const *target) {
+    latency_op(TFS_OP_UNLINK);
+    state_change_begin();
+    int ret = file_unlink(target);
+    state_change_end();
+
+    return ret;
+}
+
+/**
+ * Arguments of tfs_list_entry
+ */
+typedef struct {
+    void (*callback)(char const *name, size_t size, void *arg);
+    void *arg;
+} tfs_list_args_t;
+
+/**
+ * Pass an entry of the root directory on to the tfs_list callback.
+ *
+ * Input:
+ *   - name: entry name
+ *   - inumber: inumber of the entry's inode
+ *   - arg: tfs_list arguments
+ */
+static void tfs_list_entry(char const *name, int inumber, void *arg) {
+    tfs_list_args_t const *args = arg;
+
+    char path_name[MAX_FILE_NAME + 1];
+    path_name[0] = '/';
+    strncpy(path_name + 1, name, MAX_FILE_NAME);
+    path_name[MAX_FILE_NAME] = '\0';
+
+    rwl_rdlock(&inode_syncs[inumber].lock);
+    size_t size = inode_get(inumber)->i_size;
+    rwl_unlock(&inode_syncs[inumber].lock);
+
+    args->callback(path_name, size, args->arg);
+}
+
+int tfs_list(void (*callback)(char const *name, size_t size, void *arg),
+             void *arg) {
+    latency_op(TFS_OP_STAT);
+    tfs_list_args_t args = {.callback = callback, .arg = arg};
+
+    rwl_rdlock(&inode_syncs[ROOT_DIR_INUM].lock);
+    inode_t const *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_list: root dir inode must exist");
+
+    int ret = dir_for_each(root_dir_inode, tfs_list_entry, &args);
+    rwl_unlock(&inode_syncs[ROOT_DIR_INUM].lock);
+
+    return ret;
+}
+
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-    struct stat stat_buffer;
+    // opens source file
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
 
-    if (stat(source_path, &stat_buffer) == -1 ||
-        stat_buffer.st_size > state_block_size()) {
-        // pathname does not exist or file size exceeds block size
+    // the file must fit in a TécnicoFS file
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) == -1 ||
+        (size_t)stat_buffer.st_size > state_max_file_size()) {
+        close(fd);
         return -1;
     }
 
-    size_t source_size = (size_t)stat_buffer.st_size;
+    // the source file is mapped, so its pages are copied straight into the
+    // destination file's blocks, with no buffer in between
+    size_t size = (size_t)stat_buffer.st_size;
+    char const *source = NULL;
+    if (size > 0) {
+        source = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (source == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        posix_madvise((void *)source, size, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
 
-    rwl_rdlock(&inode_locks[ROOT_DIR_INUM]);
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_copy_from_external_fs: root dir inode must exist");
+    // creates the destination file, or deletes its current content
+    int fhandle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    int ret = fhandle == -1 ? -1 : 0;
 
-    int fhandle;
-    if (tfs_lookup(dest_path, root_dir_inode) == -1) {
-        // if file doesn't exist, create it
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-        fhandle = tfs_open(dest_path, TFS_O_CREAT);
-    } else {
-        // if file exists, delete current content
-        rwl_unlock(&inode_locks[ROOT_DIR_INUM]);
-        fhandle = tfs_open(dest_path, TFS_O_TRUNC);
+    // written in chunks, so that the file's lock is let go in between
+    for (size_t copied = 0; ret == 0 && copied < size;) {
+        size_t to_write = size - copied;
+        if (to_write > IMPORT_CHUNK_SIZE) {
+            to_write = IMPORT_CHUNK_SIZE;
+        }
+
+        if (tfs_write(fhandle, source + copied, to_write) !=
+            (ssize_t)to_write) {
+            ret = -1; // the FS is full
+        }
+        copied += to_write;
     }
 
-    if (fhandle == -1)
+    if (size > 0) {
+        munmap((void *)source, size);
+    }
+    if (fhandle != -1 && tfs_close(fhandle) == -1) {
         return -1;
+    }
 
-    if (source_size == 0) {
-        // nothing to copy
-        tfs_close(fhandle);
-        return 0;
+    return ret;
+}
+
+/**
+ * Write the whole of some buffers to a host file, at its current offset.
+ *
+ * Input:
+ *   - fd: the host file
+ *   - iov: the buffers, in order (changed to skip what was written)
+ *   - iovcnt: number of buffers
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int external_writev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skips the buffers that were written, and what was of the next one
+        size_t left = (size_t)written;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
     }
 
-    // opens source file
-    int fd = open(source_path, O_RDONLY);
-    if (fd == -1)
-        return -1;
+    return 0;
+}
 
-    // reads source file content to a buffer
-    char buffer[source_size];
-    if (read(fd, buffer, source_size) < source_size)
+/**
+ * Release some leases.
+ *
+ * Input:
+ *   - leases: the leases
+ *   - count: number of leases
+ */
+static void leases_release(tfs_lease_t *leases, int count) {
+    for (int i = 0; i < count; i++) {
+        tfs_release_lease(&leases[i]);
+    }
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int fhandle = tfs_open(source_path, 0);
+    if (fhandle == -1) {
         return -1;
-    close(fd);
+    }
 
-    // writes the buffer content in destination file
-    if (tfs_write(fhandle, buffer, source_size) == -1) {
+    // only the bytes the file has now are copied, even if it keeps growing
+    // (starting at the head of a ring file)
+    tfs_stat_t stat;
+    int ret = tfs_stat(fhandle, &stat);
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ret == -1 || fd == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
         tfs_close(fhandle);
         return -1;
     }
-    tfs_close(fhandle);
 
-    return 0;
+    // the blocks are leased a batch at a time, and each batch is written to
+    // the host file at once, straight from the blocks' memory; no lock is held
+    // while the host file is written
+    size_t offset = stat.head;
+    bool truncated = false;
+    while (ret == 0 && offset < stat.size && !truncated) {
+        tfs_lease_t leases[EXPORT_BATCH_LEASES];
+        struct iovec iov[EXPORT_BATCH_LEASES];
+        int count = 0;
+        while (count < EXPORT_BATCH_LEASES && offset < stat.size) {
+            tfs_lease_t *lease = &leases[count];
+            if (tfs_read_lease(fhandle, lease, stat.size - offset, offset) ==
+                -1) {
+                // (or the ring file wrapped around meanwhile, or the cache
+                // can't hold more leased blocks until these are released)
+                ret = count > 0 ? 0 : -1;
+                break;
+            }
+            if (lease->len == 0) {
+                // the file was truncated meanwhile
+                tfs_release_lease(lease);
+                truncated = true;
+                break;
+            }
+
+            iov[count].iov_base = (void *)lease->data;
+            iov[count].iov_len = lease->len;
+            offset += lease->len;
+            count++;
+        }
+
+        if (count > 0 && external_writev(fd, iov, count) == -1) {
+            ret = -1;
+        }
+        leases_release(leases, count);
+
+        // A ring file whose head moved past the bytes left to copy wrapped
+        // around over them while the batch was written, so the copy can't be
+        // finished
+        tfs_stat_t now;
+        if (ret == 0 && (tfs_stat(fhandle, &now) == -1 || now.head > offset)) {
+            ret = -1;
+        }
+    }
+
+    if (close(fd) == -1) {
+        ret = -1;
+    }
+    if (tfs_close(fhandle) == -1) {
+        ret = -1;
+    }
+
+    return ret;
 }
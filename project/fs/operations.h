@@ -2,7 +2,86 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Attributes of a file (see tfs_stat).
+ */
+typedef struct {
+    size_t head;    // offset of the first byte still in the file (see
+                    // tfs_make_ring), 0 unless it's a ring file
+    size_t size;    // size of the file, in bytes
+    int hard_links; // number of hard links to the file
+} tfs_stat_t;
+
+/**
+ * Read lease on the contents of a file (see tfs_read_lease).
+ */
+typedef struct {
+    void const *data; // leased bytes, read-only (in inline_copy, if they're
+                      // copied, so the lease itself isn't to be copied)
+    size_t len;       // number of leased bytes (0 if past the end of the file)
+    int inumber;      // leased file's inode (-1 once released)
+    int block;        // data block holding them, referenced by the lease (-1
+                      // if none)
+    char inline_copy[INODE_INLINE_SIZE]; // the leased bytes, if the file's
+                                         // data is kept in its inode
+} tfs_lease_t;
+
+/**
+ * TécnicoFS storage latency models, emulating the latency of each access to
+ * the FS state as if it was really stored in secondary memory.
+ */
+typedef enum {
+    TFS_LATENCY_NONE,  // no latency
+    TFS_LATENCY_SPIN,  // busy loop of latency_spins iterations
+    TFS_LATENCY_SLEEP, // sleep for latency_ns nanoseconds
+    TFS_LATENCY_TABLE, // sleep for the latency of the access class, read from
+                       // the latency_table_path file
+} tfs_latency_model_t;
+
+/**
+ * Classes of accesses to the FS state.
+ */
+typedef enum {
+    TFS_ACCESS_INODE,       // inodes
+    TFS_ACCESS_INODE_TABLE, // inode allocation table
+    TFS_ACCESS_DIR,         // directory entries
+    TFS_ACCESS_BITMAP,      // free blocks bitmap
+    TFS_ACCESS_BLOCK,       // data blocks
+    TFS_ACCESS_CLASSES,
+} tfs_access_class_t;
+
+/**
+ * Classes of TécnicoFS operations, to which accesses to the FS state are
+ * attributed.
+ */
+typedef enum {
+    TFS_OP_OTHER,    // tfs_init, tfs_destroy, tfs_make_ring, ...
+    TFS_OP_OPEN,     // tfs_open
+    TFS_OP_CLOSE,    // tfs_close
+    TFS_OP_READ,     // tfs_read, tfs_pread, tfs_readv and tfs_preadv
+    TFS_OP_WRITE,    // tfs_write, tfs_pwrite, tfs_writev and tfs_pwritev
+    TFS_OP_LEASE,    // tfs_read_lease and tfs_release_lease
+    TFS_OP_LINK,     // tfs_link and tfs_sym_link
+    TFS_OP_UNLINK,   // tfs_unlink
+    TFS_OP_CLONE,    // tfs_clone
+    TFS_OP_STAT,     // tfs_size, tfs_stat and tfs_list
+    TFS_OP_SNAPSHOT, // tfs_snapshot
+    TFS_OPS,
+} tfs_op_t;
+
+/**
+ * How the memory holding the FS is committed, when it isn't kept in an image
+ * file.
+ */
+typedef enum {
+    TFS_ARENA_LAZY,     // page by page, when first written
+    TFS_ARENA_PREFAULT, // all at once, in the background, after tfs_init
+    TFS_ARENA_HUGE,     // page by page, in transparent huge pages
+} tfs_arena_mode_t;
 
 /**
  * TécnicoFS parameters.
@@ -13,8 +92,50 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // path name of the image file (in the OS' file system) holding the FS,
+    // which outlives the process; if NULL, the FS is only kept in memory
+    char const *image_path;
+    // maximum time (in milliseconds) before metadata updates to the image are
+    // committed to its journal; if 0, they're only committed by tfs_sync (or
+    // once the journal's buffer is half full)
+    size_t journal_flush_interval_ms;
+    // number of data blocks of the image file kept in memory, in a cache (with
+    // at least BLOCK_CACHE_MIN_FRAMES blocks); if 0, they're all mapped
+    size_t block_cache_size;
+    // how the memory holding the FS is committed, if there's no image file
+    tfs_arena_mode_t arena_mode;
+
+    // storage latency model, and its parameters
+    tfs_latency_model_t latency_model;
+    size_t latency_spins;
+    size_t latency_ns;
+    // file with a "<access class> <latency in ns>" line per access class
+    // (inode, inode_table, dir, bitmap or block), classes not listed have no
+    // latency
+    char const *latency_table_path;
 } tfs_params;
 
+/**
+ * TécnicoFS storage latency statistics, per access class and per operation
+ * class (each access counting towards the operation that made it).
+ */
+typedef struct {
+    uint64_t accesses[TFS_ACCESS_CLASSES];
+    uint64_t latency_ns[TFS_ACCESS_CLASSES]; // emulated latency
+    uint64_t op_accesses[TFS_OPS];
+    uint64_t op_latency_ns[TFS_OPS]; // emulated latency
+} tfs_latency_stats_t;
+
+/**
+ * TécnicoFS block cache statistics.
+ */
+typedef struct {
+    uint64_t hits;       // data block accesses that found the block cached
+    uint64_t misses;     // ... that read it from the image file
+    uint64_t writebacks; // changed blocks written back to the image file
+} tfs_cache_stats_t;
+
 /**
  * Return a sane default set of parameters for tecnicofs.
  */
@@ -22,12 +143,14 @@ tfs_params tfs_default_params();
 
 /**
  * Initialize tecnicofs, optionally with a given configuration.
+ * If an image file is given and it already holds a FS (formatted with the same
+ * parameters), that FS is used, otherwise a new one is created.
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Destroy tecnicofs, writing the FS back to its image file (if any).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
@@ -43,6 +166,8 @@ typedef enum {
 
 /**
  * Open a file.
+ * Symlinks are followed (up to SYMLINK_MAX_DEPTH of them, so loops fail), and
+ * where a chain of them ends is cached until some name changes.
  *
  * Input:
  *   - name: absolute path name
@@ -77,8 +202,24 @@ int tfs_sym_link(char const *target, char const *link_name);
  */
 int tfs_link(char const *target_file, char const *link_name);
 
+/**
+ * Clone a file: create a new file with the same contents, which shares the
+ * data blocks of the original (so it's created in constant time, without
+ * copying them) but is independent from it; a shared block is only copied
+ * once either file writes to it (copy-on-write).
+ *
+ * Input:
+ *   - source: absolute path name of the file to clone
+ *   - dest: absolute path name of the clone to be created
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_clone(char const *source, char const *dest);
+
 /**
  * Close a file.
+ * If the file was deleted while open, and this was its last handle (and there
+ * are no leases on it), it's only freed now.
  *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
@@ -113,9 +254,166 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file, starting at the given offset. The file handle's
+ * current offset is neither used nor updated, so the same handle can be used
+ * by several threads at once.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: offset in the file where the write starts; writing past the end
+ *     of the file leaves a gap that reads as zeros
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file, starting at the given offset. The file handle's
+ * current offset is neither used nor updated, so the same handle can be used
+ * by several threads at once.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: offset in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Write the contents of several buffers to an open file, in order, starting at
+ * the current offset. The whole write is a single operation, costing the same
+ * locking as a tfs_write.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: buffers containing the contents to write
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were written (can be lower than the length
+ * of the buffers if the maximum file size is exceeded), or -1 in case of
+ * error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into several buffers, in order, starting at the
+ * current offset. The whole read is a single operation, costing the same
+ * locking as a tfs_read.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: destination buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their length if the file size was reached), or -1 in case
+ * of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Same as tfs_writev, but starting at the given offset, like tfs_pwrite.
+ */
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t offset);
+
+/**
+ * Same as tfs_readv, but starting at the given offset, like tfs_pread.
+ */
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt,
+                   size_t offset);
+
+/**
+ * Lease the contents of an open file, starting at the given offset, to read
+ * them in place instead of copying them.
+ *
+ * The leased bytes stay valid until the lease is released (even if the file is
+ * closed, truncated or deleted meanwhile), but are only as many as there are in
+ * the block with the offset. The lease holds a reference to that block, like a
+ * clone (see tfs_clone), so writes to the file leave the leased bytes as they
+ * are, copying the block first. The bytes of a file whose data is still kept
+ * in its inode (up to INODE_INLINE_SIZE bytes) are copied into the lease
+ * instead, as the inode's data is changed in place.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - lease: where to store the lease
+ *   - len: maximum number of bytes to lease
+ *   - offset: offset in the file where the leased bytes start
+ *
+ * Returns 0 if successful (the lease must then be released with
+ * tfs_release_lease, even if it has no bytes), -1 otherwise (including when
+ * the leased blocks already take half of the block cache, if it's used).
+ */
+int tfs_read_lease(int fhandle, tfs_lease_t *lease, size_t len, size_t offset);
+
+/**
+ * Release a lease obtained with tfs_read_lease.
+ *
+ * Input:
+ *   - lease: the lease
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_release_lease(tfs_lease_t *lease);
+
+/**
+ * Get the size of an open file, without waiting for ongoing reads or writes;
+ * meant to be polled, e.g. to know whether a file grew past some offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns the size of the file (as of some point during the call), or -1 in
+ * case of error.
+ */
+ssize_t tfs_size(int fhandle);
+
+/**
+ * Get the attributes of an open file, like tfs_size. They're consistent with
+ * each other, as of some point during the call.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - stat: where to store the attributes
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(int fhandle, tfs_stat_t *stat);
+
+/**
+ * Make an empty file a ring file, of the given capacity.
+ *
+ * A ring file keeps only its last `capacity` bytes: writes past that wrap
+ * around and overwrite the oldest bytes, advancing the file's head (see
+ * tfs_stat) past them, so the file never takes up more than `capacity` bytes
+ * while its offsets keep growing. Reading or leasing before the head, or
+ * writing before it or past the end of the file, fails; writes past the
+ * oldest bytes still being read (e.g. through a lease) may change them.
+ * Truncating the file empties it, but it stays a ring.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - capacity: number of bytes the file keeps (at most the maximum file size)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_make_ring(int fhandle, size_t capacity);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
+ * A file that's still open (or leased) loses its name right away, and can
+ * still be used through its handles, but its inode and blocks are only freed
+ * once it's closed (and its leases released), without making this wait.
  *
  * Input:
  *   - target: path name of the target (in TécnicoFS)
@@ -126,7 +424,10 @@ int tfs_unlink(char const *target);
 
 /**
  * Copy the contents of a file that exists in the OS' file system tree
- * (outside TécnicoFS) to the TécnicoFS.
+ * (outside TécnicoFS) to the TécnicoFS. The file is mapped in memory and
+ * written from there in chunks of IMPORT_CHUNK_SIZE bytes, so it may span any
+ * number of blocks; the bytes it has when the copy starts are copied (it must
+ * not be truncated meanwhile, or the process is killed by SIGBUS).
  *
  * Input:
  *   - source_path: path name of the source file (from the OS' file system)
@@ -137,4 +438,81 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy the contents of a file that exists in TécnicoFS to the OS' file system
+ * tree (outside TécnicoFS). The bytes the file has when the copy starts are
+ * written to the destination file straight from the file's blocks, leasing
+ * EXPORT_BATCH_LEASES of them at a time, so writers of the file are never held
+ * back by the copy (the copy of a ring file fails if it wraps around over the
+ * bytes not copied yet).
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *    which is created if needed, and overwritten if it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Wait for every metadata update made so far to be committed to the journal
+ * (if the FS is kept in an image file), so that it survives a crash.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync();
+
+/**
+ * Take a consistent snapshot of the whole FS (as of some point during the
+ * call), writing it to an image file that can later be passed to tfs_init.
+ *
+ * The FS keeps being used meanwhile: operations that change it are only held
+ * up while the snapshot's metadata is copied, and data blocks are copied to
+ * the snapshot before they're first changed (copy-on-write); the remaining
+ * blocks are streamed to the file by the calling thread. The FS must not be
+ * destroyed until the call returns.
+ *
+ * Input:
+ *   - path: path name of the snapshot file (in the OS' file system), which
+ *     is overwritten if it already exists
+ *
+ * Returns 0 if successful, -1 otherwise (e.g., if another snapshot is being
+ * taken).
+ */
+int tfs_snapshot(char const *path);
+
+/**
+ * Obtain the storage latency statistics since tecnicofs was initialized.
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_latency_stats(tfs_latency_stats_t *stats);
+
+/**
+ * Obtain the block cache statistics since tecnicofs was initialized (all 0 if
+ * the data blocks aren't cached).
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_cache_stats(tfs_cache_stats_t *stats);
+
+/**
+ * List the files in TécnicoFS.
+ *
+ * Input:
+ *   - callback: function called with the absolute path name and the size of
+ *     each file (it must not call other TécnicoFS functions)
+ *   - arg: argument passed on to callback
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_list(void (*callback)(char const *name, size_t size, void *arg),
+             void *arg);
+
 #endif // OPERATIONS_H
@@ -1,45 +1,155 @@
 #include "state.h"
 #include "betterassert.h"
+#include "arena.h"
+#include "cache.h"
+#include "journal.h"
+#include "latency.h"
 #include "locks.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in an image, either in primary memory or, when an image file is
+ * given, mapped from that file, so that it outlives the process).
  */
 static tfs_params fs_params;
 
+/**
+ * FS image header, stored at the start of the image
+ */
+typedef struct {
+    uint64_t magic;   // IMAGE_MAGIC once the image is formatted
+    uint32_t version; // IMAGE_VERSION
+    uint32_t clean;   // whether the FS was cleanly shut down
+
+    // parameters the image was formatted with
+    size_t max_inode_count;
+    size_t max_block_count;
+    size_t block_size;
+    size_t inode_size;
+
+    // allocation state that's only kept in memory while the FS is running
+    size_t free_inodes_count;
+    size_t free_blocks_hint;
+} image_header_t;
+
+static char *image;
+static size_t image_size;
+static int image_fd = -1; // -1 if the image is only kept in memory
+static image_header_t *image_header;
+
 // Inode table
 static inode_t *inode_table;
 static allocation_state_t *freeinode_ts;
-static pthread_mutex_t freeinode_lock;
-static pthread_rwlock_t *inode_locks;
+static int *free_inodes; // stack of the free inumbers
+static size_t free_inodes_count;
+static alignas(CACHE_LINE_SIZE) pthread_mutex_t freeinode_lock;
+static inode_sync_t *inode_syncs; // lock, seqlock and leases of each inode
 
 // Data blocks
-static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
-static pthread_mutex_t free_blocks_lock;
+static char *fs_data; // # blocks * block size, NULL if the blocks are cached
+static size_t image_data_offset; // of fs_data, in the image
+static size_t image_mapped_size; // the data blocks aren't, if they're cached
+static uint64_t *free_blocks; // bitmap, a set bit means the block is taken
+// Number of block pointers referencing each data block (in inodes and pointer
+// blocks), more than 1 if it's shared by clones; only accessed atomically
+static uint32_t *block_refs;
+static size_t free_blocks_hint; // word where the next search for a free block
+                                // starts (next-fit, moved back to the lowest
+                                // word freed since)
+static alignas(CACHE_LINE_SIZE) pthread_mutex_t free_blocks_lock;
 
 /*
  * Volatile FS state
  */
+// A file handle is a slot in the open file table and the generation of the
+// slot (in its state) when the handle was returned, so closed handles aren't
+// mistaken for the handles of later opens reusing the slot
 static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
-static pthread_mutex_t free_open_file_entries_lock;
+static unsigned open_file_slot_bits; // low bits of a handle with its slot
+
+static char *zero_block; // what the blocks that were never written read as
+
+// One bit per word of the free blocks bitmap, set if every block in it is
+// taken, so that the search for a free block skips full words 64 at a time;
+// protected by free_blocks_lock
+static uint64_t *free_blocks_full;
+
+// Root directory index (from entry names to their slots in the directory),
+// protected by the root inode's lock
+static int *dir_index_buckets; // first slot of each bucket (-1 if empty)
+static size_t dir_index_bucket_count; // a power of 2
+static size_t *dir_slot_hashes;       // hash of the name in each slot
+static int *dir_index_next;           // for each slot, the next one in its
+                                      // bucket (-1 if it's the last)
+static int *dir_free_slots;           // stack of the empty slots
+static size_t dir_free_slots_count;
+static size_t dir_slot_count; // slots in the directory's blocks
+// Bumped whenever a name may stop resolving to the file it did (see
+// symlink_cache_get)
+static atomic_uint namespace_generation;
+
+// Snapshot being taken (see state_snapshot)
+// Held for reading by every operation that changes the persistent state, and
+// for writing while the snapshot's metadata is copied (the flip)
+static pthread_rwlock_t snapshot_lock;
+static pthread_mutex_t snapshot_flip_lock; // held during the flip
+static atomic_bool snapshot_flipping;      // whether the flip is waited for
+static atomic_bool snapshot_running;       // whether blocks must be saved
+// State of each data block in the snapshot, protected by snapshot_blocks_lock
+static unsigned char *snapshot_blocks;
+static pthread_mutex_t snapshot_blocks_lock;
+static pthread_cond_t snapshot_copied_cond; // signals a block was copied
+static int snapshot_fd;       // snapshot file
+static bool snapshot_failed;  // whether copying some block failed
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
+#define OPEN_FILE_TAKEN (1u)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define BLOCK_POINTERS (BLOCK_SIZE / sizeof(int))
+#define BITMAP_WORD_BITS (sizeof(uint64_t) * CHAR_BIT)
+#define FREE_BLOCKS_WORDS                                                      \
+    ((DATA_BLOCKS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define FULL_WORDS_WORDS                                                       \
+    ((FREE_BLOCKS_WORDS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+#define IMAGE_MAGIC (0x31534654u) // "TFS1"
+#define IMAGE_VERSION (4)
+
+/**
+ * State of a data block in the snapshot being taken
+ */
+typedef enum {
+    SNAPSHOT_BLOCK_DONE,    // copied to the snapshot (or free when taken)
+    SNAPSHOT_BLOCK_PENDING, // not changed since the snapshot was taken
+    SNAPSHOT_BLOCK_COPYING, // being copied, must not be changed meanwhile
+} snapshot_block_t;
+#define IMAGE_ALIGNMENT (64) // tables start on their own cache line
+
+static void dir_index_reset(size_t slot_count);
+static void free_blocks_summarize(void);
+static int dir_index_rebuild(inode_t const *inode);
+static int state_recover(void);
+static void image_journal(void const *addr, size_t len);
+static int image_sync(void);
+static void snapshot_block_save(int block_number);
+static void block_pointers_free(int block_number, int depth);
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -49,46 +159,226 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
+static inline size_t file_handle_slot(int file_handle) {
+    return (size_t)file_handle & ((1u << open_file_slot_bits) - 1);
+}
+
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 && file_handle_slot(file_handle) < MAX_OPEN_FILES;
+}
+
+/**
+ * Make the handle of an open file table slot, given its state.
+ *
+ * The generation is truncated to the bits left in a (non-negative) int, so a
+ * handle is only mistaken for another once the slot is reused that many
+ * times.
+ */
+static inline int file_handle_make(size_t slot, unsigned state) {
+    if (!(state & OPEN_FILE_TAKEN)) {
+        return -1; // free slot, no handle
+    }
+
+    unsigned generation =
+        (state >> 1) & ((unsigned)INT_MAX >> open_file_slot_bits);
+    return (int)((generation << open_file_slot_bits) | (unsigned)slot);
 }
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
+ * Maximum size of a file, given by the number of blocks reachable through the
+ * direct, indirect and double indirect block pointers of an inode.
+ */
+size_t state_max_file_size(void) {
+    return (INODE_DIRECT_BLOCKS + BLOCK_POINTERS +
+            BLOCK_POINTERS * BLOCK_POINTERS) *
+           BLOCK_SIZE;
+}
+
+/**
+ * Reserve a region of the FS image.
+ *
+ * Input:
+ *   - offset: end of the regions reserved so far, advanced past the new one
+ *   - size: size of the region
+ *   - alignment: alignment of the start of the region
+ *
+ * Returns the offset of the region.
+ */
+static size_t image_region(size_t *offset, size_t size, size_t alignment) {
+    size_t start = (*offset + alignment - 1) / alignment * alignment;
+    *offset = start + size;
+    return start;
+}
+
+/**
+ * Lay out the persistent FS state in the FS image, pointing each table to its
+ * region.
+ *
+ * Input:
+ *   - base: start of the image, or NULL to only compute its size
  *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
+ * Returns the size of the image.
+ */
+static size_t image_layout(char *base) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = 0;
+
+    size_t header =
+        image_region(&offset, sizeof(image_header_t), IMAGE_ALIGNMENT);
+    size_t inodes = image_region(&offset, INODE_TABLE_SIZE * sizeof(inode_t),
+                                 IMAGE_ALIGNMENT);
+    size_t inodes_state = image_region(
+        &offset, INODE_TABLE_SIZE * sizeof(allocation_state_t),
+        IMAGE_ALIGNMENT);
+    size_t inodes_stack =
+        image_region(&offset, INODE_TABLE_SIZE * sizeof(int), IMAGE_ALIGNMENT);
+    size_t blocks_bitmap = image_region(
+        &offset, FREE_BLOCKS_WORDS * sizeof(uint64_t), IMAGE_ALIGNMENT);
+    size_t blocks_refs =
+        image_region(&offset, DATA_BLOCKS * sizeof(uint32_t), IMAGE_ALIGNMENT);
+    // data blocks start on a page boundary, so they're never split across
+    // more pages than needed
+    size_t data = image_region(&offset, DATA_BLOCKS * BLOCK_SIZE, page_size);
+
+    if (base != NULL) {
+        image_header = (image_header_t *)(base + header);
+        inode_table = (inode_t *)(base + inodes);
+        freeinode_ts = (allocation_state_t *)(base + inodes_state);
+        free_inodes = (int *)(base + inodes_stack);
+        free_blocks = (uint64_t *)(base + blocks_bitmap);
+        block_refs = (uint32_t *)(base + blocks_refs);
+        fs_data = base + data;
+        image_data_offset = data;
+    }
+
+    return offset;
+}
+
+/**
+ * Map the FS image file in memory, creating it if it doesn't exist.
  *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
+ * Input:
+ *   - path: path name of the image file (in the OS' file system)
+ *   - format: where to store whether the image must be formatted
  *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ * Returns 0 if successful, -1 otherwise.
  *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Possible errors:
+ *   - The file can't be opened, created or mapped.
+ *   - The file isn't a TFS image with the same parameters.
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static int image_map(char const *path, bool *format) {
+    image_fd = open(path, O_RDWR | O_CREAT, 0640);
+    if (image_fd == -1) {
+        return -1;
+    }
+
+    struct stat stat_buffer;
+    if (fstat(image_fd, &stat_buffer) == -1) {
+        close(image_fd);
+        image_fd = -1;
+        return -1;
+    }
+
+    if (stat_buffer.st_size == 0) {
+        // new image
+        if (ftruncate(image_fd, (off_t)image_size) == -1) {
+            close(image_fd);
+            image_fd = -1;
+            return -1;
+        }
+    } else if ((size_t)stat_buffer.st_size != image_size) {
+        close(image_fd);
+        image_fd = -1;
+        return -1; // not an image with these parameters
+    }
+
+    image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 image_fd, 0);
+    if (image == MAP_FAILED) {
+        image = NULL;
+        close(image_fd);
+        image_fd = -1;
+        return -1;
+    }
+    image_layout(image);
+
+    // The magic number is only written once formatting is done, so an image
+    // without one never got to be used
+    *format = image_header->magic != IMAGE_MAGIC;
+    if (!*format && (image_header->version != IMAGE_VERSION ||
+                     image_header->max_inode_count != INODE_TABLE_SIZE ||
+                     image_header->max_block_count != DATA_BLOCKS ||
+                     image_header->block_size != BLOCK_SIZE ||
+                     image_header->inode_size != sizeof(inode_t))) {
+        munmap(image, image_size);
+        image = NULL;
+        close(image_fd);
+        image_fd = -1;
+        return -1; // image formatted with other parameters
+    }
+
+    return 0;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Format the FS image: every inode and data block is free, except for the
+ * root directory.
+ *
+ * Returns 0 if successful, -1 otherwise.
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Possible errors:
+ *   - The root directory couldn't be created.
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static int image_format(void) {
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        freeinode_ts[i] = FREE;
+        // pushed in reverse order, so that the lowest inumbers (starting with
+        // the root's) are handed out first
+        free_inodes[i] = (int)(INODE_TABLE_SIZE - 1 - i);
     }
+    free_inodes_count = INODE_TABLE_SIZE;
+
+    for (size_t i = 0; i < FREE_BLOCKS_WORDS; i++) {
+        free_blocks[i] = 0;
+    }
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        block_refs[i] = 0;
+    }
+    // the bits past the last block are marked as taken, so they're never
+    // handed out
+    for (size_t i = DATA_BLOCKS; i < FREE_BLOCKS_WORDS * BITMAP_WORD_BITS;
+         i++) {
+        free_blocks[i / BITMAP_WORD_BITS] |= (uint64_t)1
+                                             << (i % BITMAP_WORD_BITS);
+    }
+    free_blocks_hint = 0;
+    free_blocks_summarize();
+
+    // create root inode
+    if (inode_create(T_DIRECTORY) != ROOT_DIR_INUM) {
+        return -1;
+    }
+
+    image_header->version = IMAGE_VERSION;
+    image_header->max_inode_count = INODE_TABLE_SIZE;
+    image_header->max_block_count = DATA_BLOCKS;
+    image_header->block_size = BLOCK_SIZE;
+    image_header->inode_size = sizeof(inode_t);
+    image_header->magic = IMAGE_MAGIC;
+
+    return 0;
 }
 
 /**
  * Initialize FS state.
  *
+ * If params.image_path is set, the persistent state is kept in that file
+ * (mapped in memory), and an image left by a previous run is used as is.
+ * Otherwise, a new (empty) FS is created in memory.
+ *
  * Input:
  *   - params: TécnicoFS parameters
  *
@@ -97,6 +387,8 @@ static void insert_delay(void) {
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The image file couldn't be mapped, or was formatted with other
+ *     parameters, or is corrupted beyond repair.
  */
 int state_init(tfs_params params) {
     fs_params = params;
@@ -105,36 +397,143 @@ int state_init(tfs_params params) {
         return -1; // already initialized
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    inode_locks = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+    if (latency_init(&params) == -1) {
+        return -1; // invalid latency model
+    }
 
-    if (!inode_table || !freeinode_ts || !inode_locks || !fs_data ||
-        !free_blocks || !open_file_table || !free_open_file_entries) {
+    // (the sizes of these are multiples of the cache line size)
+    inode_syncs =
+        aligned_alloc(CACHE_LINE_SIZE, INODE_TABLE_SIZE * sizeof(inode_sync_t));
+    open_file_table = aligned_alloc(
+        CACHE_LINE_SIZE, MAX_OPEN_FILES * sizeof(open_file_entry_t));
+    zero_block = calloc(1, BLOCK_SIZE);
+
+    // the directory index starts with room for the root's first block, and
+    // grows along with it
+    dir_index_bucket_count = 1;
+    while (dir_index_bucket_count < DIR_ENTRIES_PER_BLOCK) {
+        dir_index_bucket_count *= 2;
+    }
+    dir_index_buckets = malloc(dir_index_bucket_count * sizeof(int));
+    dir_slot_hashes = malloc(DIR_ENTRIES_PER_BLOCK * sizeof(size_t));
+    dir_index_next = malloc(DIR_ENTRIES_PER_BLOCK * sizeof(int));
+    dir_free_slots = malloc(DIR_ENTRIES_PER_BLOCK * sizeof(int));
+    free_blocks_full = malloc(FULL_WORDS_WORDS * sizeof(uint64_t));
+
+    if (!inode_syncs || !open_file_table || !zero_block || !dir_index_buckets ||
+        !dir_slot_hashes || !dir_index_next || !dir_free_slots ||
+        !free_blocks_full) {
         return -1; // allocation failed
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
-        rwl_init(&inode_locks[i]);
+    image_size = image_layout(NULL);
+    bool format = true;
+    if (params.image_path != NULL) {
+        if (image_map(params.image_path, &format) == -1) {
+            return -1;
+        }
+    } else {
+        image = arena_alloc(image_size, params.arena_mode);
+        if (image == NULL) {
+            return -1; // allocation failed
+        }
+        image_layout(image);
     }
-    mutex_init(&freeinode_lock);
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        rwl_init(&inode_syncs[i].lock);
+        atomic_init(&inode_syncs[i].leases, 0);
+        atomic_init(&inode_syncs[i].seq, 0);
+        atomic_init(&inode_syncs[i].refs, 0);
+        atomic_init(&inode_syncs[i].symlink_target, 0);
     }
+    atomic_init(&namespace_generation, 0);
+    mutex_init(&freeinode_lock);
     mutex_init(&free_blocks_lock);
+    rwl_init(&snapshot_lock);
+    mutex_init(&snapshot_flip_lock);
+    mutex_init(&snapshot_blocks_lock);
+    cond_init(&snapshot_copied_cond);
+    atomic_init(&snapshot_flipping, false);
+    atomic_init(&snapshot_running, false);
+
+    // handles keep their slot in as few bits as possible, leaving the others
+    // for the generation
+    open_file_slot_bits = 0;
+    while (((size_t)1 << open_file_slot_bits) < MAX_OPEN_FILES) {
+        open_file_slot_bits++;
+    }
+    if (open_file_slot_bits >= sizeof(int) * CHAR_BIT - 1) {
+        return -1; // too many open files for the handles to fit in an int
+    }
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        atomic_init(&open_file_table[i].of_state, 0);
         mutex_init(&open_file_table[i].lock);
     }
-    mutex_init(&free_open_file_entries_lock);
+
+    if (format) {
+        if (image_format() == -1) {
+            return -1;
+        }
+    } else if (image_header->clean) {
+        // Everything is where the previous run left it, only the directory
+        // index (which isn't persistent) has to be rebuilt
+        free_inodes_count = image_header->free_inodes_count;
+        free_blocks_hint = image_header->free_blocks_hint;
+        free_blocks_summarize();
+        if (dir_index_rebuild(&inode_table[ROOT_DIR_INUM]) == -1) {
+            return -1;
+        }
+    } else {
+        // Redoes the updates committed to the journal, and then repairs the
+        // ones that weren't
+        if (journal_replay(params.image_path, image, image_size) == -1 ||
+            state_recover() == -1) {
+            return -1; // image corrupted
+        }
+    }
+
+    if (image_fd != -1) {
+        // Until state_destroy, the image may be left inconsistent, only the
+        // updates committed to the journal are sure to survive a crash
+        image_header->clean = 0;
+        if (msync(image, image_size, MS_SYNC) == -1) {
+            return -1;
+        }
+
+        image_mapped_size = image_size;
+        if (params.block_cache_size > 0) {
+            // From now on, the data blocks are read from and written back to
+            // the image file through the cache, instead of being mapped
+            if (block_cache_init(image_fd, image_data_offset, BLOCK_SIZE,
+                                 DATA_BLOCKS, params.block_cache_size) == -1) {
+                return -1;
+            }
+            munmap(fs_data, image_size - image_data_offset);
+            fs_data = NULL;
+            image_mapped_size = image_data_offset;
+        }
+
+        if (journal_init(params.image_path, image, image_size,
+                         params.journal_flush_interval_ms, image_sync) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Write every update made so far back to the image file, and sync it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_sync(void) {
+    if (block_cache_flush() == -1 ||
+        msync(image, image_mapped_size, MS_SYNC) == -1) {
+        return -1;
+    }
 
     return 0;
 }
@@ -142,65 +541,121 @@ int state_init(tfs_params params) {
 /**
  * Destroy FS state.
  *
+ * If the persistent state is kept in an image file, it is written back and
+ * marked as cleanly shut down.
+ *
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        rwl_destroy(&inode_locks[i]);
+        // Unlinked files still open (or leased) are deleted, as their handles
+        // (and leases) are dropped
+        if (atomic_load_explicit(&inode_syncs[i].refs, memory_order_relaxed) &
+            INODE_ORPHAN) {
+            atomic_store_explicit(&inode_syncs[i].leases, 0,
+                                  memory_order_relaxed);
+            inode_delete((int)i);
+        }
+        rwl_destroy(&inode_syncs[i].lock);
     }
     mutex_destroy(&freeinode_lock);
 
     mutex_destroy(&free_blocks_lock);
 
+    rwl_destroy(&snapshot_lock);
+    mutex_destroy(&snapshot_flip_lock);
+    mutex_destroy(&snapshot_blocks_lock);
+    cond_destroy(&snapshot_copied_cond);
+
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         mutex_destroy(&open_file_table[i].lock);
     }
-    mutex_destroy(&free_open_file_entries_lock);
 
-    free(inode_table);
-    free(freeinode_ts);
-    free(inode_locks);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+    int ret = 0;
+    if (image_fd != -1) {
+        if (journal_destroy() == -1) {
+            ret = -1;
+        }
+
+        image_header->free_inodes_count = free_inodes_count;
+        image_header->free_blocks_hint = free_blocks_hint;
+
+        // The clean flag is only set once everything else is on disk
+        if (image_sync() == -1) {
+            ret = -1;
+        } else {
+            image_header->clean = 1;
+            if (msync(image, image_mapped_size, MS_SYNC) == -1) {
+                ret = -1;
+            }
+        }
 
+        if (block_cache_destroy() == -1) {
+            ret = -1;
+        }
+        munmap(image, image_mapped_size);
+        close(image_fd);
+        image_fd = -1;
+    } else {
+        arena_free(image);
+    }
+
+    free(inode_syncs);
+    free(open_file_table);
+    free(zero_block);
+    free(dir_index_buckets);
+    free(dir_slot_hashes);
+    free(dir_index_next);
+    free(dir_free_slots);
+    free(free_blocks_full);
+
+    image = NULL;
+    image_header = NULL;
     inode_table = NULL;
     freeinode_ts = NULL;
+    free_inodes = NULL;
     fs_data = NULL;
     free_blocks = NULL;
+    block_refs = NULL;
+    inode_syncs = NULL;
     open_file_table = NULL;
-    free_open_file_entries = NULL;
-
-    return 0;
+    zero_block = NULL;
+    dir_index_buckets = NULL;
+    dir_slot_hashes = NULL;
+    dir_index_next = NULL;
+    dir_free_slots = NULL;
+    free_blocks_full = NULL;
+
+    return ret;
 }
 
 /**
  * (Try to) Allocate a new inode in the inode table, without initializing its
  * data.
  *
+ * The inumber is popped from the free inodes stack, so allocation takes
+ * constant time regardless of how many inodes are taken.
+ * Must be called with freeinode_lock held.
+ *
  * Returns the inumber of the newly allocated inode, or -1 in the case of error.
  *
  * Possible errors:
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
+    if (free_inodes_count == 0) {
+        return -1; // no free inodes
+    }
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+    insert_delay(TFS_ACCESS_INODE_TABLE); // simulate storage access delay
 
-            return (int)inumber;
-        }
-    }
+    int inumber = free_inodes[--free_inodes_count];
+    ALWAYS_ASSERT(freeinode_ts[inumber] == FREE,
+                  "inode_alloc: free inodes stack holds a taken inode");
+    freeinode_ts[inumber] = TAKEN;
+    journal_log(&freeinode_ts[inumber], sizeof(allocation_state_t));
 
-    // no free inodes
-    return -1;
+    return inumber;
 }
 
 /**
@@ -208,8 +663,8 @@ static int inode_alloc(void) {
  *
  * Allocates and initializes a new inode.
  * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * set to BLOCK_SIZE. Regular files will not have any data block allocated
+ * (i_size will be set to 0 and every block pointer to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -229,77 +684,90 @@ int inode_create(inode_type i_type) {
     }
 
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    insert_delay(TFS_ACCESS_INODE); // simulate storage access delay
 
     mutex_unlock(&freeinode_lock);
 
     inode->i_node_type = i_type;
+    // (a directory's entries are looked up in place, in its blocks)
+    inode->i_inline = i_type != T_DIRECTORY;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_direct_blocks[i] = -1;
+    }
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
+    inode->i_ring_capacity = 0;
+    inode->i_ring_head = 0;
+
     switch (i_type) {
     case T_DIRECTORY: {
         // Initializes directory (filling its block with empty entries, labeled
         // with inumber==-1)
-        // Since there can only be one directory (root) and it is only
-        // initialized once at the creation of the TFS, we don't need to lock
-        // the free blocks table (there won't be multi-threading here)
         int b = data_block_alloc();
         if (b == -1) {
             // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
+            inode_size_set(inode, 0);
 
             // run regular deletion process
             inode_delete(inumber);
             return -1;
         }
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-        inode_table[inumber].hard_links = 1;
+        inode_table[inumber].i_direct_blocks[0] = b;
+        inode_size_set(inode, BLOCK_SIZE);
+        inode_links_set(inode, 1);
 
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_edit(b);
         ALWAYS_ASSERT(dir_entry != NULL,
                       "inode_create: data block freed while in use");
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
             dir_entry[i].d_inumber = -1;
         }
+        data_block_edited(dir_entry);
+        image_journal(dir_entry, BLOCK_SIZE);
+        data_block_put(dir_entry);
+        dir_index_reset(DIR_ENTRIES_PER_BLOCK);
     } break;
     case T_FILE:
     case T_SYM_LINK:
         // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].hard_links = 1;
+        inode_size_set(inode, 0);
+        inode_links_set(inode, 1);
         break;
     default:
         PANIC("inode_create: unknown file type");
     }
+    journal_log(&inode_table[inumber], sizeof(inode_t));
 
     return inumber;
 }
 
 /**
  * Delete an inode.
+ * It must no longer be reachable, nor referenced (see inode_ref_get).
  *
  * Input:
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
     // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+    insert_delay(TFS_ACCESS_INODE);
+    insert_delay(TFS_ACCESS_INODE_TABLE);
 
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
-
-    mutex_lock(&freeinode_lock);
     ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
                   "inode_delete: inode already freed");
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
-    }
+    // The inode is no longer reachable, so its blocks are freed (once its
+    // leases are gone) before holding up every other allocation
+    inode_truncate(&inode_table[inumber]);
+    atomic_store_explicit(&inode_syncs[inumber].refs, 0, memory_order_relaxed);
 
+    mutex_lock(&freeinode_lock);
     freeinode_ts[inumber] = FREE;
+    journal_log(&freeinode_ts[inumber], sizeof(allocation_state_t));
+    free_inodes[free_inodes_count++] = inumber;
     mutex_unlock(&freeinode_lock);
 }
 
@@ -314,221 +782,1848 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
+    insert_delay(TFS_ACCESS_INODE); // simulate storage access delay to inode
     return &inode_table[inumber];
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Obtain the number of the data block holding a given block of a file.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
+ *   - inode: file's inode
+ *   - block_index: index of the block within the file
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ * Returns the block number, or -1 if that block isn't allocated.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+int inode_block_get(inode_t const *inode, size_t block_index) {
+    ALWAYS_ASSERT(!inode->i_inline, "inode_block_get: inode has no blocks");
+
+    if (block_index < INODE_DIRECT_BLOCKS) {
+        return inode->i_direct_blocks[block_index];
+    }
+    block_index -= INODE_DIRECT_BLOCKS;
+
+    if (block_index < BLOCK_POINTERS) {
+        if (inode->i_indirect_block == -1) {
+            return -1;
+        }
+
+        int const *indirect = data_block_get(inode->i_indirect_block);
+        int block_number = indirect[block_index];
+        data_block_put(indirect);
+        return block_number;
     }
+    block_index -= BLOCK_POINTERS;
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
+    if (block_index < BLOCK_POINTERS * BLOCK_POINTERS) {
+        if (inode->i_double_indirect_block == -1) {
+            return -1;
+        }
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
+        int const *double_indirect =
+            data_block_get(inode->i_double_indirect_block);
+        int indirect_block = double_indirect[block_index / BLOCK_POINTERS];
+        data_block_put(double_indirect);
+        if (indirect_block == -1) {
+            return -1;
         }
+
+        int const *indirect = data_block_get(indirect_block);
+        int block_number = indirect[block_index % BLOCK_POINTERS];
+        data_block_put(indirect);
+        return block_number;
     }
-    return -1; // sub_name not found
+
+    return -1; // beyond the maximum file size
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Allocate a new data block.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ *   - depth: levels of indirection below the block (0 for a data block); the
+ *     block pointers of a pointer block are all initialized to -1
  *
- * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ * Returns the block number, or -1 if there are no free data blocks.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+static int block_new(int depth) {
+    int block_number = data_block_alloc();
+    if (block_number == -1) {
+        return -1; // no free data blocks
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    if (depth > 0) {
+        int *entries = data_block_edit(block_number);
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            entries[i] = -1;
+        }
+        data_block_edited(entries);
+        image_journal(entries, BLOCK_SIZE);
+        data_block_put(entries);
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    return block_number;
+}
+
+/**
+ * Obtain a block with the contents of a given one that can be changed through
+ * the caller's block pointer: the block itself, unless it's shared with
+ * clones, in which case it's copied and the caller's reference to it is
+ * dropped (copy-on-write).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - depth: levels of indirection below the block (0 for a data block); the
+ *     blocks referenced by a copied pointer block become shared by the copy
+ *
+ * Returns the block number, or -1 if there are no free data blocks.
+ */
+static int block_unshare(int block_number, int depth) {
+    if (__atomic_load_n(&block_refs[block_number], __ATOMIC_ACQUIRE) <= 1) {
+        return block_number; // only referenced by the caller
+    }
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    int copy_number = data_block_alloc();
+    if (copy_number == -1) {
+        return -1; // no free data blocks
+    }
 
-            return 0;
+    void const *block = data_block_get(block_number);
+    void *copy = data_block_edit(copy_number);
+    memcpy(copy, block, BLOCK_SIZE);
+    if (depth > 0) {
+        int const *entries = copy;
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            if (entries[i] != -1) {
+                data_block_ref(entries[i]);
+            }
         }
     }
+    data_block_edited(copy);
+    if (depth > 0) {
+        image_journal(copy, BLOCK_SIZE);
+    }
+    data_block_put(copy);
+    data_block_put(block);
 
-    return -1; // no space for entry
+    // (freed after all, if the other references were dropped meanwhile)
+    block_pointers_free(block_number, depth);
+    return copy_number;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Make a block pointer (in an inode) reference a data block that can be
+ * changed, allocating one (or copying a shared one) if needed.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns inumber linked to the target name, -1 if errors occur.
+ *   - pointer: the block pointer
+ *   - depth: levels of indirection below the block (0 for a data block)
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
+ * Returns the block number, or -1 if there are no free data blocks.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+static int block_pointer_alloc(int *pointer, int depth) {
+    int block_number = *pointer == -1 ? block_new(depth)
+                                       : block_unshare(*pointer, depth);
+    if (block_number == -1) {
+        return -1; // no free data blocks
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
-
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    if (block_number != *pointer) {
+        *pointer = block_number;
+        journal_log(pointer, sizeof(int));
+    }
+    return block_number;
+}
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
-        }
+/**
+ * Make a block pointer in a pointer block (that can be changed) reference a
+ * data block that can be changed, allocating one (or copying a shared one) if
+ * needed.
+ *
+ * Input:
+ *   - indirect_block: the block holding the block pointer
+ *   - index: index of the block pointer in that block
+ *   - depth: levels of indirection below the referenced block
+ *
+ * Returns the block number, or -1 if there are no free data blocks.
+ */
+static int block_entry_alloc(int indirect_block, size_t index, int depth) {
+    int const *entries = data_block_get(indirect_block);
+    int entry = entries[index];
+    data_block_put(entries);
+
+    int block_number =
+        entry == -1 ? block_new(depth) : block_unshare(entry, depth);
+    if (block_number == -1) {
+        return -1; // no free data blocks
+    }
 
-    return -1; // entry not found
+    if (block_number != entry) {
+        int *pointers = data_block_edit(indirect_block);
+        pointers[index] = block_number;
+        data_block_edited(pointers);
+        image_journal(&pointers[index], sizeof(int));
+        data_block_put(pointers);
+    }
+    return block_number;
 }
 
 /**
- * Allocate a new data block.
+ * Obtain the number of the data block holding a given block of a file, to
+ * change it, allocating it (and any indirect blocks needed to reach it) if
+ * needed; blocks shared with clones on the way are copied first.
  *
- * Returns block number/index if successful, -1 otherwise.
+ * Input:
+ *   - inode: file's inode
+ *   - block_index: index of the block within the file
+ *
+ * Returns the block number, or -1 in the case of error.
  *
  * Possible errors:
  *   - No free data blocks.
+ *   - block_index is beyond the maximum file size.
  */
-int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+int inode_block_alloc(inode_t *inode, size_t block_index) {
+    ALWAYS_ASSERT(!inode->i_inline, "inode_block_alloc: inode has no blocks");
+
+    if (block_index < INODE_DIRECT_BLOCKS) {
+        return block_pointer_alloc(&inode->i_direct_blocks[block_index], 0);
+    }
+    block_index -= INODE_DIRECT_BLOCKS;
+
+    if (block_index < BLOCK_POINTERS) {
+        if (block_pointer_alloc(&inode->i_indirect_block, 1) == -1) {
+            return -1;
         }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
+        return block_entry_alloc(inode->i_indirect_block, block_index, 0);
+    }
+    block_index -= BLOCK_POINTERS;
+
+    if (block_index < BLOCK_POINTERS * BLOCK_POINTERS) {
+        if (block_pointer_alloc(&inode->i_double_indirect_block, 2) == -1) {
+            return -1;
+        }
 
-            return (int)i;
+        int indirect_block = block_entry_alloc(
+            inode->i_double_indirect_block, block_index / BLOCK_POINTERS, 1);
+        if (indirect_block == -1) {
+            return -1;
         }
+
+        return block_entry_alloc(indirect_block, block_index % BLOCK_POINTERS,
+                                 0);
     }
-    return -1;
+
+    return -1; // beyond the maximum file size
 }
 
 /**
- * Free a data block.
+ * Drop a reference to a data block, freeing it once it has none left, along
+ * with (the references it holds to) the blocks reachable through it.
  *
  * Input:
  *   - block_number: the block number/index
+ *   - depth: levels of indirection below the block (0 for a data block)
  */
-void data_block_free(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_free: invalid block number");
+static void block_pointers_free(int block_number, int depth) {
+    if (data_block_unref(block_number) > 0) {
+        return; // still referenced by clones
+    }
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    if (depth > 0) {
+        int const *entries = data_block_get(block_number);
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            if (entries[i] != -1) {
+                block_pointers_free(entries[i], depth - 1);
+            }
+        }
+        data_block_put(entries);
+    }
 
-    mutex_lock(&free_blocks_lock);
-    free_blocks[block_number] = FREE;
-    mutex_unlock(&free_blocks_lock);
+    data_block_free(block_number);
 }
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Free every data block of a file (that isn't inline), leaving its block
+ * pointers empty.
  *
  * Input:
- *   - block_number: the block number/index
+ *   - inode: file's inode
+ */
+static void inode_blocks_free(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_direct_blocks[i] != -1) {
+            block_pointers_free(inode->i_direct_blocks[i], 0);
+            inode->i_direct_blocks[i] = -1;
+        }
+    }
+
+    if (inode->i_indirect_block != -1) {
+        block_pointers_free(inode->i_indirect_block, 1);
+        inode->i_indirect_block = -1;
+    }
+
+    if (inode->i_double_indirect_block != -1) {
+        block_pointers_free(inode->i_double_indirect_block, 2);
+        inode->i_double_indirect_block = -1;
+    }
+}
+
+/**
+ * Free every data block of a file, leaving it empty (and inline, unless it's a
+ * directory).
+ * Leased blocks are only freed once their leases are released, as each lease
+ * holds a reference to its block.
  *
- * Returns a pointer to the first byte of the block.
+ * Input:
+ *   - inode: file's inode
  */
-void *data_block_get(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_get: invalid block number");
+void inode_truncate(inode_t *inode) {
+    if (!inode->i_inline) {
+        inode_blocks_free(inode);
+    }
+    inode->i_inline = inode->i_node_type != T_DIRECTORY;
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    // (a ring file stays a ring)
+    inode_extent_set(inode, 0, 0);
+    journal_log(inode, sizeof(inode_t));
 }
 
 /**
- * Add a new entry to the open file table.
+ * Move the data of an inline file to data blocks, so that it can outgrow its
+ * inode.
+ * Must be called with the inode's lock held for writing. The read leases on
+ * the inode have their own copy of its inline data, so they aren't waited for.
  *
  * Input:
- *   - inumber: inode number of the file to open
- *   - offset: initial offset
+ *   - inode: file's inode
  *
- * Returns file handle if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks (the file is left inline).
+ */
+int inode_inline_promote(inode_t *inode) {
+    ALWAYS_ASSERT(inode->i_inline && inode->i_size <= INODE_INLINE_SIZE,
+                  "inode_inline_promote: inode isn't inline");
+
+    // the data is kept aside, as the block pointers take its place
+    char data[INODE_INLINE_SIZE];
+    size_t size = inode->i_size;
+    memcpy(data, inode->i_inline_data, size);
+
+    inode->i_inline = false;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_direct_blocks[i] = -1;
+    }
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
+
+    // (an inline ring file never wrapped around, its bytes are at their
+    // offsets)
+    for (size_t offset = 0; offset < size;) {
+        size_t block_offset = offset % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > size - offset) {
+            chunk = size - offset;
+        }
+
+        int block_number = inode_block_alloc(inode, offset / BLOCK_SIZE);
+        if (block_number == -1) {
+            inode_blocks_free(inode);
+            memcpy(inode->i_inline_data, data, size);
+            inode->i_inline = true;
+            return -1;
+        }
+
+        char *block = data_block_edit(block_number);
+        ALWAYS_ASSERT(block != NULL,
+                      "inode_inline_promote: data block freed while in use");
+        memcpy(block + block_offset, data + offset, chunk);
+        data_block_edited(block);
+        data_block_put(block);
+        offset += chunk;
+    }
+
+    journal_log(inode, sizeof(inode_t));
+    return 0;
+}
+
+/**
+ * Make an (empty) file a clone of another, sharing all of its data blocks,
+ * which are only copied once either file changes them.
+ * Must be called with the source's lock held, and the clone's lock held for
+ * writing (or before the clone is used by anyone else).
+ *
+ * Input:
+ *   - clone: the clone's inode
+ *   - source: the source file's inode
+ */
+void inode_clone(inode_t *clone, inode_t const *source) {
+    ALWAYS_ASSERT(clone->i_size == 0 && clone->i_indirect_block == -1 &&
+                      clone->i_double_indirect_block == -1,
+                  "inode_clone: clone isn't empty");
+
+    clone->i_inline = source->i_inline;
+    if (source->i_inline) {
+        // there are no blocks to share, the data is simply copied
+        memcpy(clone->i_inline_data, source->i_inline_data, source->i_size);
+        clone->i_ring_capacity = source->i_ring_capacity;
+        inode_extent_set(clone, source->i_ring_head, source->i_size);
+        journal_log(clone, sizeof(inode_t));
+        return;
+    }
+
+    // Only the blocks the inode points to gain a reference, the ones below
+    // them are shared through them
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        clone->i_direct_blocks[i] = source->i_direct_blocks[i];
+        if (clone->i_direct_blocks[i] != -1) {
+            data_block_ref(clone->i_direct_blocks[i]);
+        }
+    }
+    clone->i_indirect_block = source->i_indirect_block;
+    if (clone->i_indirect_block != -1) {
+        data_block_ref(clone->i_indirect_block);
+    }
+    clone->i_double_indirect_block = source->i_double_indirect_block;
+    if (clone->i_double_indirect_block != -1) {
+        data_block_ref(clone->i_double_indirect_block);
+    }
+
+    clone->i_ring_capacity = source->i_ring_capacity;
+    inode_extent_set(clone, source->i_ring_head, source->i_size);
+    journal_log(clone, sizeof(inode_t));
+}
+
+/**
+ * Take a reference to an inode (for an open file handle or a lease), so that
+ * it isn't deleted until it's dropped, even if it's unlinked meanwhile.
+ * Must be called while the inode can't be unlinked, i.e. with the lock of the
+ * directory holding it or another reference held.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_ref_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_ref_get: invalid inumber");
+
+    atomic_fetch_add_explicit(&inode_syncs[inumber].refs, 1,
+                              memory_order_relaxed);
+}
+
+/**
+ * Drop a reference to an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns true if it was the last reference to an unlinked inode, which the
+ * caller must then delete (within state_change_begin/end), false otherwise.
+ */
+bool inode_ref_put(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_ref_put: invalid inumber");
+
+    unsigned refs = atomic_fetch_sub_explicit(&inode_syncs[inumber].refs, 1,
+                                              memory_order_acq_rel);
+    ALWAYS_ASSERT((refs & ~INODE_ORPHAN) > 0,
+                  "inode_ref_put: inode isn't referenced");
+
+    return refs == (INODE_ORPHAN | 1);
+}
+
+/**
+ * Mark an inode whose last link was removed as unlinked, deferring its
+ * deletion to whoever drops its last reference.
+ * Must be called after it's removed from its directory, so that no new
+ * references to it can be taken.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns true if there are no references to the inode, so the caller must
+ * delete it right away, false otherwise.
+ */
+bool inode_unlinked(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlinked: invalid inumber");
+
+    unsigned refs =
+        atomic_load_explicit(&inode_syncs[inumber].refs, memory_order_acquire);
+    do {
+        ALWAYS_ASSERT(!(refs & INODE_ORPHAN),
+                      "inode_unlinked: inode already unlinked");
+        if (refs == 0) {
+            return true;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &inode_syncs[inumber].refs, &refs, refs | INODE_ORPHAN,
+        memory_order_acq_rel, memory_order_acquire));
+
+    return false;
+}
+
+/**
+ * Take a read lease on the blocks of an inode, so that they aren't freed until
+ * it's released (the inode's lock doesn't have to be held meanwhile).
+ * A lease is also a reference to the inode (see inode_ref_get).
+ * Must be called with the inode's lock held.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_lease_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_lease_get: invalid inumber");
+
+    inode_ref_get(inumber);
+    atomic_fetch_add_explicit(&inode_syncs[inumber].leases, 1,
+                              memory_order_relaxed);
+}
+
+/**
+ * Release a read lease on the blocks of an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns true if the lease was the last reference to an unlinked inode, which
+ * the caller must then delete (see inode_ref_put), false otherwise.
+ */
+bool inode_lease_put(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_lease_put: invalid inumber");
+
+    unsigned leases = atomic_fetch_sub_explicit(&inode_syncs[inumber].leases, 1,
+                                                memory_order_release);
+    ALWAYS_ASSERT(leases > 0, "inode_lease_put: inode isn't leased");
+
+    return inode_ref_put(inumber);
+}
+
+/**
+ * Start changing the size or number of links of an inode.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static void inode_seq_begin(inode_t const *inode) {
+    atomic_fetch_add_explicit(&inode_syncs[inode - inode_table].seq, 1,
+                              memory_order_relaxed);
+}
+
+/**
+ * Finish changing the size or number of links of an inode.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static void inode_seq_end(inode_t const *inode) {
+    atomic_fetch_add_explicit(&inode_syncs[inode - inode_table].seq, 1,
+                              memory_order_release);
+}
+
+/**
+ * Set the size of an inode, so that it's seen by inode_stat.
+ * Must be called with the inode's lock held for writing (or before the inode
+ * is used by anyone else).
+ *
+ * Input:
+ *   - inode: the inode
+ *   - size: its new size
+ */
+void inode_size_set(inode_t *inode, size_t size) {
+    inode_seq_begin(inode);
+    // (released, so it isn't seen before the counter is odd)
+    __atomic_store_n(&inode->i_size, size, __ATOMIC_RELEASE);
+    inode_seq_end(inode);
+}
+
+/**
+ * Set the head and size of an inode, so that they're seen together by
+ * inode_stat.
+ * Must be called with the inode's lock held for writing (or before the inode
+ * is used by anyone else).
+ *
+ * Input:
+ *   - inode: the inode
+ *   - head: its new head (0 unless it's a ring file)
+ *   - size: its new size
+ */
+void inode_extent_set(inode_t *inode, size_t head, size_t size) {
+    inode_seq_begin(inode);
+    // (released, so they aren't seen before the counter is odd)
+    __atomic_store_n(&inode->i_ring_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&inode->i_size, size, __ATOMIC_RELEASE);
+    inode_seq_end(inode);
+}
+
+/**
+ * Set the number of hard links of an inode, so that it's seen by inode_stat.
+ * Must be called with the inode's lock held for writing (or before the inode
+ * is used by anyone else).
+ *
+ * Input:
+ *   - inode: the inode
+ *   - hard_links: its new number of hard links
+ */
+void inode_links_set(inode_t *inode, int hard_links) {
+    inode_seq_begin(inode);
+    // (released, so it isn't seen before the counter is odd)
+    __atomic_store_n(&inode->hard_links, hard_links, __ATOMIC_RELEASE);
+    inode_seq_end(inode);
+}
+
+/**
+ * Get the head, size and number of hard links of an inode, without locking it.
+ * They're read together, as they were after some change.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *   - head: where to store its head (0 unless it's a ring file)
+ *   - size: where to store its size
+ *   - hard_links: where to store its number of hard links
+ */
+void inode_stat(int inumber, size_t *head, size_t *size, int *hard_links) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_stat: invalid inumber");
+
+    insert_delay(TFS_ACCESS_INODE); // simulate storage access delay to inode
+
+    inode_t const *inode = &inode_table[inumber];
+    unsigned seq;
+    do {
+        seq = atomic_load_explicit(&inode_syncs[inumber].seq,
+                                   memory_order_acquire);
+        if (seq & 1) {
+            continue; // being changed
+        }
+
+        // (acquired, so they aren't read after the counter is checked again)
+        *head = __atomic_load_n(&inode->i_ring_head, __ATOMIC_ACQUIRE);
+        *size = __atomic_load_n(&inode->i_size, __ATOMIC_ACQUIRE);
+        *hard_links = __atomic_load_n(&inode->hard_links, __ATOMIC_ACQUIRE);
+    } while ((seq & 1) || atomic_load_explicit(&inode_syncs[inumber].seq,
+                                               memory_order_relaxed) != seq);
+}
+
+/**
+ * Log an update to an inode (made by the caller) in the journal.
+ *
+ * Input:
+ *   - inode: the updated inode
+ */
+void inode_journal(inode_t const *inode) {
+    journal_log(inode, sizeof(inode_t));
+}
+
+/**
+ * Hash a directory entry name (FNV-1a).
+ *
+ * Input:
+ *   - name: entry name
+ *
+ * Returns the hash, whose lowest bits choose the entry's bucket in the root
+ * directory index.
+ */
+static size_t dir_index_hash(char const *name) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211u;
+    }
+
+    return (size_t)hash;
+}
+
+static inline size_t dir_index_bucket(size_t hash) {
+    return hash & (dir_index_bucket_count - 1);
+}
+
+/**
+ * Obtain a pointer to a directory entry from its slot.
+ * Its block must be released with data_block_put (after data_block_edited, if
+ * it's obtained to be changed).
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - slot: index of the entry in the directory
+ *   - edit: whether the entry will be changed
+ *
+ * Returns pointer to the entry.
+ */
+static dir_entry_t *dir_entry_get(inode_t const *inode, int slot, bool edit) {
+    // Locates the block containing the entry
+    int block_number =
+        inode_block_get(inode, (size_t)slot / DIR_ENTRIES_PER_BLOCK);
+    ALWAYS_ASSERT(block_number != -1,
+                  "dir_entry_get: directory slot must have a data block");
+    dir_entry_t *dir_entry =
+        (dir_entry_t *)(edit ? data_block_edit(block_number)
+                             : data_block_get(block_number));
+
+    return &dir_entry[(size_t)slot % DIR_ENTRIES_PER_BLOCK];
+}
+
+/**
+ * Empty the root directory index, leaving every slot of the directory free.
+ *
+ * Input:
+ *   - slot_count: number of slots in the directory
+ */
+static void dir_index_reset(size_t slot_count) {
+    for (size_t i = 0; i < dir_index_bucket_count; i++) {
+        dir_index_buckets[i] = -1;
+    }
+
+    // pushed in reverse order, so that the first slots are filled first
+    for (size_t i = 0; i < slot_count; i++) {
+        dir_index_next[i] = -1;
+        dir_free_slots[i] = (int)(slot_count - 1 - i);
+    }
+    dir_free_slots_count = slot_count;
+    dir_slot_count = slot_count;
+}
+
+/**
+ * Double the number of buckets in the root directory index, redistributing
+ * its entries (using their stored hashes, so no directory block is read).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+static int dir_index_rehash(void) {
+    size_t old_bucket_count = dir_index_bucket_count;
+    int *old_buckets = dir_index_buckets;
+
+    int *buckets = malloc(2 * old_bucket_count * sizeof(int));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    dir_index_buckets = buckets;
+    dir_index_bucket_count = 2 * old_bucket_count;
+    for (size_t i = 0; i < dir_index_bucket_count; i++) {
+        dir_index_buckets[i] = -1;
+    }
+
+    for (size_t i = 0; i < old_bucket_count; i++) {
+        int slot = old_buckets[i];
+        while (slot != -1) {
+            int next = dir_index_next[slot];
+            size_t bucket = dir_index_bucket(dir_slot_hashes[slot]);
+            dir_index_next[slot] = dir_index_buckets[bucket];
+            dir_index_buckets[bucket] = slot;
+            slot = next;
+        }
+    }
+
+    free(old_buckets);
+    return 0;
+}
+
+/**
+ * Grow the root directory by one block of empty entries.
+ *
+ * Input:
+ *   - inode: directory inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - The directory reached the maximum file size.
+ *   - malloc failure.
+ */
+static int dir_grow(inode_t *inode) {
+    size_t slot_count = dir_slot_count + DIR_ENTRIES_PER_BLOCK;
+    if (slot_count > INT_MAX) {
+        return -1; // slots wouldn't fit in an int
+    }
+
+    // Makes room for the new slots in the index first, so that a failure
+    // leaves the directory untouched
+    size_t *hashes = realloc(dir_slot_hashes, slot_count * sizeof(size_t));
+    if (hashes == NULL) {
+        return -1;
+    }
+    dir_slot_hashes = hashes;
+
+    int *next = realloc(dir_index_next, slot_count * sizeof(int));
+    if (next == NULL) {
+        return -1;
+    }
+    dir_index_next = next;
+
+    int *free_slots = realloc(dir_free_slots, slot_count * sizeof(int));
+    if (free_slots == NULL) {
+        return -1;
+    }
+    dir_free_slots = free_slots;
+
+    int block_number = inode_block_alloc(inode, inode->i_size / BLOCK_SIZE);
+    if (block_number == -1) {
+        return -1; // no free data blocks
+    }
+
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_edit(block_number);
+    for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry[i].d_inumber = -1;
+        memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
+    }
+    data_block_edited(dir_entry);
+    image_journal(dir_entry, BLOCK_SIZE);
+    data_block_put(dir_entry);
+    inode_size_set(inode, inode->i_size + BLOCK_SIZE);
+    journal_log(inode, sizeof(inode_t));
+
+    // pushed in reverse order, so that the first slots are filled first
+    for (size_t i = slot_count; i > dir_slot_count; i--) {
+        dir_index_next[i - 1] = -1;
+        dir_free_slots[dir_free_slots_count++] = (int)(i - 1);
+    }
+    dir_slot_count = slot_count;
+
+    // Keeps (at most) one slot per bucket, so that buckets stay short
+    if (dir_slot_count > dir_index_bucket_count && dir_index_rehash() == -1) {
+        WARN("dir_grow: couldn't grow the directory index")
+    }
+
+    return 0;
+}
+
+/**
+ * Look up the slot of an entry in the root directory index.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: entry name
+ *   - prev_slot: where to store the slot preceding the entry in its bucket
+ *     (-1 if it's the first one), can be NULL
+ *
+ * Returns the slot of the entry, or -1 if there's no entry named sub_name.
+ */
+static int dir_index_find(inode_t const *inode, char const *sub_name,
+                          int *prev_slot) {
+    size_t hash = dir_index_hash(sub_name);
+    int prev = -1;
+    for (int slot = dir_index_buckets[dir_index_bucket(hash)]; slot != -1;
+         slot = dir_index_next[slot]) {
+        // Only reads the entry (and its block) if the hashes match
+        if (dir_slot_hashes[slot] == hash) {
+            dir_entry_t const *dir_entry = dir_entry_get(inode, slot, false);
+            bool found =
+                strncmp(dir_entry->d_name, sub_name, MAX_FILE_NAME) == 0;
+            data_block_put(dir_entry);
+            if (found) {
+                if (prev_slot != NULL) {
+                    *prev_slot = prev;
+                }
+                return slot;
+            }
+        }
+        prev = slot;
+    }
+
+    return -1;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    insert_delay(TFS_ACCESS_DIR);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    int prev_slot;
+    int slot = dir_index_find(inode, sub_name, &prev_slot);
+    if (slot == -1) {
+        return -1; // sub_name not found
+    }
+
+    // Unlinks the entry from its bucket
+    if (prev_slot == -1) {
+        dir_index_buckets[dir_index_bucket(dir_slot_hashes[slot])] =
+            dir_index_next[slot];
+    } else {
+        dir_index_next[prev_slot] = dir_index_next[slot];
+    }
+    dir_index_next[slot] = -1;
+    dir_free_slots[dir_free_slots_count++] = slot;
+
+    namespace_changed();
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot, true);
+    dir_entry->d_inumber = -1;
+    memset(dir_entry->d_name, 0, MAX_FILE_NAME);
+    data_block_edited(dir_entry);
+    image_journal(dir_entry, sizeof(dir_entry_t));
+    data_block_put(dir_entry);
+    return 0;
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory is full of entries and can't grow.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+
+    insert_delay(TFS_ACCESS_DIR); // simulate storage access delay to directory
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    if (dir_free_slots_count == 0 && dir_grow(inode) == -1) {
+        return -1; // no space for entry
+    }
+
+    // Fills an empty entry and adds it to the index (no cached symlink
+    // resolution goes through a name that didn't exist, so none changes)
+    int slot = dir_free_slots[--dir_free_slots_count];
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot, true);
+    dir_entry->d_inumber = sub_inumber;
+    strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    data_block_edited(dir_entry);
+    image_journal(dir_entry, sizeof(dir_entry_t));
+
+    size_t hash = dir_index_hash(dir_entry->d_name);
+    data_block_put(dir_entry);
+    size_t bucket = dir_index_bucket(hash);
+    dir_slot_hashes[slot] = hash;
+    dir_index_next[slot] = dir_index_buckets[bucket];
+    dir_index_buckets[bucket] = slot;
+
+    return 0;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    insert_delay(TFS_ACCESS_DIR); // simulate storage access delay to directory
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Looks the name up in the index instead of scanning every entry
+    int slot = dir_index_find(inode, sub_name, NULL);
+    if (slot == -1) {
+        return -1; // entry not found
+    }
+
+    dir_entry_t const *dir_entry = dir_entry_get(inode, slot, false);
+    int sub_inumber = dir_entry->d_inumber;
+    data_block_put(dir_entry);
+    return sub_inumber;
+}
+
+/**
+ * Call a function for every entry of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - callback: function called with the name and inumber of each entry
+ *   - arg: argument passed on to callback
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ */
+int dir_for_each(inode_t const *inode,
+                 void (*callback)(char const *name, int inumber, void *arg),
+                 void *arg) {
+    insert_delay(TFS_ACCESS_DIR); // simulate storage access delay to directory
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    for (size_t i = 0; i < inode->i_size / BLOCK_SIZE; i++) {
+        dir_entry_t const *dir_entry =
+            (dir_entry_t const *)data_block_get(inode_block_get(inode, i));
+        for (size_t j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            if (dir_entry[j].d_inumber != -1) {
+                callback(dir_entry[j].d_name, dir_entry[j].d_inumber, arg);
+            }
+        }
+        data_block_put(dir_entry);
+    }
+
+    return 0;
+}
+
+/**
+ * Invalidate every cached symlink resolution, as some name may now resolve to
+ * another file.
+ * Must be called whenever a directory entry is cleared, or a symlink is
+ * written. Adding an entry needs no call: only resolutions that found every
+ * name of their chain are cached, and a new name wasn't in any of them.
+ */
+void namespace_changed(void) {
+    atomic_fetch_add_explicit(&namespace_generation, 1, memory_order_acq_rel);
+}
+
+/**
+ * Obtain the file a symlink was last resolved to, if nothing changed in the
+ * namespace since.
+ * Must be called with the root directory's lock held.
+ *
+ * Input:
+ *   - inumber: the symlink's inumber
+ *   - generation: where to store the current namespace generation, for
+ *     symlink_cache_set
+ *
+ * Returns the inumber of the file, or -1 if there's none cached.
+ */
+int symlink_cache_get(int inumber, unsigned *generation) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "symlink_cache_get: invalid inumber");
+
+    *generation =
+        atomic_load_explicit(&namespace_generation, memory_order_acquire);
+    uint_least64_t cached = atomic_load_explicit(
+        &inode_syncs[inumber].symlink_target, memory_order_acquire);
+    if ((unsigned)(cached >> 32) != *generation) {
+        return -1;
+    }
+
+    // (the inumber is kept off by one, so that an empty cache holds none)
+    return (int)(uint32_t)cached - 1;
+}
+
+/**
+ * Cache the file a symlink was resolved to.
+ * Must be called with the root directory's lock held, in the same critical
+ * section the symlink was resolved in.
+ *
+ * Input:
+ *   - inumber: the symlink's inumber
+ *   - target: the inumber of the file it resolves to
+ *   - generation: the namespace generation from before it was resolved (see
+ *     symlink_cache_get), so that it isn't cached if a symlink of the chain
+ *     was written meanwhile
+ */
+void symlink_cache_set(int inumber, int target, unsigned generation) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "symlink_cache_set: invalid inumber");
+    ALWAYS_ASSERT(valid_inumber(target), "symlink_cache_set: invalid target");
+
+    atomic_store_explicit(&inode_syncs[inumber].symlink_target,
+                          (uint_least64_t)generation << 32 |
+                              (uint32_t)(target + 1),
+                          memory_order_release);
+}
+
+/**
+ * Rebuild the root directory index from the entries stored in the directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The directory has a missing block.
+ *   - malloc failure.
+ */
+static int dir_index_rebuild(inode_t const *inode) {
+    size_t block_count = inode->i_size / BLOCK_SIZE;
+    size_t slot_count = block_count * DIR_ENTRIES_PER_BLOCK;
+    if (block_count == 0 || slot_count > INT_MAX) {
+        return -1;
+    }
+
+    size_t bucket_count = dir_index_bucket_count;
+    while (bucket_count < slot_count) {
+        bucket_count *= 2;
+    }
+
+    int *buckets = realloc(dir_index_buckets, bucket_count * sizeof(int));
+    if (buckets == NULL) {
+        return -1;
+    }
+    dir_index_buckets = buckets;
+    dir_index_bucket_count = bucket_count;
+
+    size_t *hashes = realloc(dir_slot_hashes, slot_count * sizeof(size_t));
+    if (hashes == NULL) {
+        return -1;
+    }
+    dir_slot_hashes = hashes;
+
+    int *next = realloc(dir_index_next, slot_count * sizeof(int));
+    if (next == NULL) {
+        return -1;
+    }
+    dir_index_next = next;
+
+    int *free_slots = realloc(dir_free_slots, slot_count * sizeof(int));
+    if (free_slots == NULL) {
+        return -1;
+    }
+    dir_free_slots = free_slots;
+
+    dir_index_reset(slot_count);
+    dir_free_slots_count = 0;
+
+    // Goes through the slots backwards, so that the empty ones are pushed in
+    // reverse order (and the first slots are filled first)
+    for (size_t i = block_count; i > 0; i--) {
+        int block_number = inode_block_get(inode, i - 1);
+        if (block_number == -1) {
+            return -1; // missing directory block
+        }
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+        for (size_t j = DIR_ENTRIES_PER_BLOCK; j > 0; j--) {
+            int slot = (int)((i - 1) * DIR_ENTRIES_PER_BLOCK + j - 1);
+            if (dir_entry[j - 1].d_inumber == -1) {
+                dir_free_slots[dir_free_slots_count++] = slot;
+                continue;
+            }
+
+            size_t hash = dir_index_hash(dir_entry[j - 1].d_name);
+            size_t bucket = dir_index_bucket(hash);
+            dir_slot_hashes[slot] = hash;
+            dir_index_next[slot] = dir_index_buckets[bucket];
+            dir_index_buckets[bucket] = slot;
+        }
+        data_block_put(dir_entry);
+    }
+
+    return 0;
+}
+
+/**
+ * Mark a data block and, if it holds block pointers, every block reachable
+ * through it as taken in the free blocks bitmap, counting the references to
+ * them.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - depth: levels of indirection below the block (0 for a data block)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - Invalid block number.
+ */
+static int block_pointers_mark(int block_number, int depth) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    block_refs[block_number]++;
+    size_t word = (size_t)block_number / BITMAP_WORD_BITS;
+    uint64_t mask = (uint64_t)1 << ((size_t)block_number % BITMAP_WORD_BITS);
+    if (free_blocks[word] & mask) {
+        return 0; // shared by clones, the blocks below were already marked
+    }
+    free_blocks[word] |= mask;
+
+    if (depth > 0) {
+        int const *entries = data_block_get(block_number);
+        int ret = 0;
+        for (size_t i = 0; i < BLOCK_POINTERS && ret == 0; i++) {
+            if (entries[i] != -1) {
+                ret = block_pointers_mark(entries[i], depth - 1);
+            }
+        }
+        data_block_put(entries);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Mark every data block of a file as taken in the free blocks bitmap.
+ *
+ * Input:
+ *   - inode: file's inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file has an invalid size or block.
+ */
+static int inode_blocks_mark(inode_t const *inode) {
+    if (inode->i_ring_capacity == 0
+            ? inode->i_ring_head != 0 || inode->i_size > state_max_file_size()
+            : inode->i_ring_capacity > state_max_file_size() ||
+                  inode->i_ring_head > inode->i_size ||
+                  inode->i_size - inode->i_ring_head > inode->i_ring_capacity) {
+        return -1; // invalid size
+    }
+
+    if (inode->i_inline) {
+        // no blocks, but the data has to fit in the inode
+        return inode->i_node_type != T_DIRECTORY &&
+                       inode->i_size <= INODE_INLINE_SIZE
+                   ? 0
+                   : -1;
+    }
+
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_direct_blocks[i] != -1 &&
+            block_pointers_mark(inode->i_direct_blocks[i], 0) == -1) {
+            return -1;
+        }
+    }
+
+    if (inode->i_indirect_block != -1 &&
+        block_pointers_mark(inode->i_indirect_block, 1) == -1) {
+        return -1;
+    }
+
+    if (inode->i_double_indirect_block != -1 &&
+        block_pointers_mark(inode->i_double_indirect_block, 2) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Bring an image that wasn't cleanly shut down back to a consistent state.
+ *
+ * Starting from the root directory, drops the entries of inodes that were
+ * never (or are no longer) taken, frees the inodes no entry refers to, fixes
+ * the link counts and rebuilds the free inodes stack and the free blocks
+ * bitmap from the blocks that are still reachable.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The root directory is missing.
+ *   - Some file has an invalid block.
+ *   - malloc failure.
+ */
+static int state_recover(void) {
+    inode_t *root_inode = &inode_table[ROOT_DIR_INUM];
+    if (freeinode_ts[ROOT_DIR_INUM] != TAKEN ||
+        root_inode->i_node_type != T_DIRECTORY) {
+        return -1; // no root directory
+    }
+
+    int *links = calloc(INODE_TABLE_SIZE, sizeof(int));
+    if (links == NULL) {
+        return -1;
+    }
+
+    // the bits past the last block stay taken, the others are set again as
+    // the reachable blocks are found
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        free_blocks[i / BITMAP_WORD_BITS] &=
+            ~((uint64_t)1 << (i % BITMAP_WORD_BITS));
+        block_refs[i] = 0;
+    }
+    free_blocks_hint = 0;
+
+    if (inode_blocks_mark(root_inode) == -1) {
+        free(links);
+        return -1;
+    }
+
+    // Counts the links to each inode, dropping the ones to free inodes
+    for (size_t i = 0; i < root_inode->i_size / BLOCK_SIZE; i++) {
+        int block_number = inode_block_get(root_inode, i);
+        if (block_number == -1) {
+            free(links);
+            return -1; // missing directory block
+        }
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_edit(block_number);
+        for (size_t j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            int inumber = dir_entry[j].d_inumber;
+            if (inumber == -1) {
+                continue;
+            }
+
+            if (!valid_inumber(inumber) || inumber == ROOT_DIR_INUM ||
+                freeinode_ts[inumber] != TAKEN) {
+                dir_entry[j].d_inumber = -1;
+                memset(dir_entry[j].d_name, 0, MAX_FILE_NAME);
+                continue;
+            }
+
+            dir_entry[j].d_name[MAX_FILE_NAME - 1] = '\0';
+            links[inumber]++;
+        }
+        data_block_edited(dir_entry);
+        data_block_put(dir_entry);
+    }
+
+    // pushed in reverse order, so that the lowest inumbers are handed out
+    // first
+    free_inodes_count = 0;
+    for (size_t i = INODE_TABLE_SIZE; i > 0; i--) {
+        int inumber = (int)(i - 1);
+        if (inumber == ROOT_DIR_INUM) {
+            continue;
+        }
+
+        if (freeinode_ts[inumber] == TAKEN && links[inumber] > 0) {
+            if (inode_blocks_mark(&inode_table[inumber]) == -1) {
+                free(links);
+                return -1;
+            }
+            inode_table[inumber].hard_links = links[inumber];
+            continue;
+        }
+
+        // unreachable, its blocks are left free in the bitmap
+        freeinode_ts[inumber] = FREE;
+        free_inodes[free_inodes_count++] = inumber;
+    }
+    free_blocks_summarize();
+
+    free(links);
+    return dir_index_rebuild(root_inode);
+}
+
+/**
+ * Rebuild the summary of the full words of the free blocks bitmap
+ * (free_blocks_full) from the bitmap.
+ */
+static void free_blocks_summarize(void) {
+    for (size_t i = 0; i < FULL_WORDS_WORDS; i++) {
+        free_blocks_full[i] = 0;
+    }
+    // the bits past the last word are set, so they're never searched
+    for (size_t i = 0; i < FULL_WORDS_WORDS * BITMAP_WORD_BITS; i++) {
+        if (i >= FREE_BLOCKS_WORDS || free_blocks[i] == UINT64_MAX) {
+            free_blocks_full[i / BITMAP_WORD_BITS] |=
+                (uint64_t)1 << (i % BITMAP_WORD_BITS);
+        }
+    }
+}
+
+/**
+ * Allocate a new data block, with a single reference.
+ *
+ * The search starts at the word of the free blocks bitmap where the previous
+ * allocation left off (next-fit), or at the lowest one freed since, and skips
+ * the full words through their summary, so that allocations don't have to
+ * go over every block taken since then.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc(void) {
+    mutex_lock(&free_blocks_lock);
+    insert_delay(TFS_ACCESS_BITMAP); // simulate storage access delay
+
+    size_t word = free_blocks_hint;
+    // (the summary word holding the hint's is gone over again last, for the
+    // words before it)
+    for (size_t i = 0; i <= FULL_WORDS_WORDS; i++) {
+        size_t summary = word / BITMAP_WORD_BITS;
+        uint64_t full = free_blocks_full[summary];
+        if (i == 0) {
+            full |= ((uint64_t)1 << (word % BITMAP_WORD_BITS)) - 1;
+        }
+
+        if (full != UINT64_MAX) {
+            // Finds the first free block (zero bit) in the first word with one
+            word = summary * BITMAP_WORD_BITS +
+                   (size_t)__builtin_ctzll(~full);
+            size_t bit = (size_t)__builtin_ctzll(~free_blocks[word]);
+            free_blocks[word] |= (uint64_t)1 << bit;
+            if (free_blocks[word] == UINT64_MAX) {
+                free_blocks_full[summary] |= (uint64_t)1
+                                             << (word % BITMAP_WORD_BITS);
+            }
+            free_blocks_hint = word;
+            int block_number = (int)(word * BITMAP_WORD_BITS + bit);
+            __atomic_store_n(&block_refs[block_number], 1, __ATOMIC_RELAXED);
+            mutex_unlock(&free_blocks_lock);
+
+            return block_number;
+        }
+
+        word = (summary + 1) % FULL_WORDS_WORDS * BITMAP_WORD_BITS;
+    }
+    mutex_unlock(&free_blocks_lock);
+
+    return -1;
+}
+
+/**
+ * Add a reference to a data block, which is then shared (by clones, or with a
+ * read lease), so that it's copied before being changed and isn't freed until
+ * the reference is dropped (see data_block_unref).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_ref(int block_number) {
+    uint32_t refs = __atomic_fetch_add(&block_refs[block_number], 1,
+                                       __ATOMIC_RELAXED);
+    ALWAYS_ASSERT(refs > 0, "data_block_ref: block is free");
+}
+
+/**
+ * Drop a reference to a data block. Once the last one is dropped, the block
+ * must be freed (with data_block_free) by the caller.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns the number of references left.
+ */
+uint32_t data_block_unref(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_unref: invalid block number");
+
+    // (released, so that whoever finds the block unshared changes it after
+    // the copies made by the owners of the dropped references)
+    uint32_t refs = __atomic_sub_fetch(&block_refs[block_number], 1,
+                                       __ATOMIC_ACQ_REL);
+    ALWAYS_ASSERT(refs != UINT32_MAX,
+                  "data_block_unref: block isn't referenced");
+    return refs;
+}
+
+/**
+ * Free a data block, whose last reference was dropped.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_free(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_free: invalid block number");
+    ALWAYS_ASSERT(__atomic_load_n(&block_refs[block_number],
+                                  __ATOMIC_RELAXED) == 0,
+                  "data_block_free: block is still referenced");
+
+    insert_delay(TFS_ACCESS_BITMAP); // simulate storage access delay
+
+    size_t word = (size_t)block_number / BITMAP_WORD_BITS;
+    uint64_t mask = (uint64_t)1 << ((size_t)block_number % BITMAP_WORD_BITS);
+
+    mutex_lock(&free_blocks_lock);
+    ALWAYS_ASSERT(free_blocks[word] & mask,
+                  "data_block_free: block already freed");
+    free_blocks[word] &= ~mask;
+    free_blocks_full[word / BITMAP_WORD_BITS] &=
+        ~((uint64_t)1 << (word % BITMAP_WORD_BITS));
+    if (word < free_blocks_hint) {
+        // so that the image is filled from its start, reusing freed blocks
+        // before reaching the end of the bitmap
+        free_blocks_hint = word;
+    }
+    mutex_unlock(&free_blocks_lock);
+}
+
+/**
+ * Start an operation that changes the persistent FS state; snapshots are only
+ * taken in between such operations.
+ */
+void state_change_begin(void) {
+    if (atomic_load_explicit(&snapshot_flipping, memory_order_relaxed)) {
+        // Waits for the flip to end, instead of holding it up (the snapshot
+        // lock lets readers in ahead of a waiting writer)
+        mutex_lock(&snapshot_flip_lock);
+        mutex_unlock(&snapshot_flip_lock);
+    }
+    rwl_rdlock(&snapshot_lock);
+}
+
+/**
+ * End an operation started with state_change_begin.
+ */
+void state_change_end(void) { rwl_unlock(&snapshot_lock); }
+
+/**
+ * Claim a data block, to copy it to the snapshot being taken.
+ * Waits for the block to be copied, if someone else is copying it.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns whether the block must be copied by the caller.
+ */
+static bool snapshot_block_claim(int block_number) {
+    mutex_lock(&snapshot_blocks_lock);
+    bool claimed = false;
+    // (the snapshot may be over by the time the block is copied)
+    while (atomic_load_explicit(&snapshot_running, memory_order_relaxed) &&
+           snapshot_blocks[block_number] == SNAPSHOT_BLOCK_COPYING) {
+        cond_wait(&snapshot_copied_cond, &snapshot_blocks_lock);
+    }
+    if (atomic_load_explicit(&snapshot_running, memory_order_relaxed) &&
+        snapshot_blocks[block_number] == SNAPSHOT_BLOCK_PENDING) {
+        snapshot_blocks[block_number] = SNAPSHOT_BLOCK_COPYING;
+        claimed = true;
+    }
+    mutex_unlock(&snapshot_blocks_lock);
+
+    return claimed;
+}
+
+/**
+ * Copy a claimed data block to the snapshot being taken.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+static void snapshot_block_copy(int block_number) {
+    void const *block = data_block_get(block_number);
+    off_t offset =
+        (off_t)(image_data_offset + (size_t)block_number * BLOCK_SIZE);
+    bool copied =
+        pwrite(snapshot_fd, block, BLOCK_SIZE, offset) == (ssize_t)BLOCK_SIZE;
+    data_block_put(block);
+
+    mutex_lock(&snapshot_blocks_lock);
+    snapshot_blocks[block_number] = SNAPSHOT_BLOCK_DONE;
+    if (!copied) {
+        snapshot_failed = true;
+    }
+    cond_broadcast(&snapshot_copied_cond);
+    mutex_unlock(&snapshot_blocks_lock);
+}
+
+/**
+ * Copy a data block that's about to change to the snapshot being taken, if it
+ * wasn't copied yet (copy-on-write).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+static void snapshot_block_save(int block_number) {
+    if (snapshot_block_claim(block_number)) {
+        snapshot_block_copy(block_number);
+    }
+}
+
+/**
+ * Take a snapshot of the FS, writing it to an image file (which can later be
+ * used by state_init).
+ *
+ * Operations that change the FS are only held up while the metadata (inodes,
+ * allocation state and free blocks bitmap) is copied. The data blocks are then
+ * copied by the caller, except for those that are about to change, which are
+ * first copied by whoever changes them.
+ *
+ * Input:
+ *   - path: path name of the snapshot file (in the OS' file system)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - A snapshot is already being taken.
+ *   - The snapshot file can't be created or written.
+ *   - malloc failure.
+ */
+int state_snapshot(char const *path) {
+    if (atomic_load_explicit(&snapshot_running, memory_order_relaxed)) {
+        return -1; // already taking one
+    }
+
+    char *metadata = malloc(image_data_offset);
+    unsigned char *blocks = malloc(DATA_BLOCKS);
+    if (metadata == NULL || blocks == NULL) {
+        free(metadata);
+        free(blocks);
+        return -1;
+    }
+
+    // (a journal left by an image that was there before doesn't apply to it)
+    int fd = journal_discard(path) == -1
+                 ? -1
+                 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1 || ftruncate(fd, (off_t)image_size) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        free(metadata);
+        free(blocks);
+        return -1;
+    }
+
+    // Flip: waits for the ongoing changes, and copies the state they left
+    mutex_lock(&snapshot_flip_lock);
+    if (atomic_load_explicit(&snapshot_running, memory_order_relaxed)) {
+        mutex_unlock(&snapshot_flip_lock);
+        close(fd);
+        free(metadata);
+        free(blocks);
+        return -1; // already taking one
+    }
+    atomic_store_explicit(&snapshot_flipping, true, memory_order_relaxed);
+    rwl_wrlock(&snapshot_lock);
+
+    memcpy(metadata, image, image_data_offset);
+    image_header_t *header = (image_header_t *)metadata;
+    header->free_inodes_count = free_inodes_count;
+    header->free_blocks_hint = free_blocks_hint;
+    // Unlinked files that are still open, and the blocks held by leases, are
+    // still taken, so the snapshot is recovered (see state_recover) when it's
+    // first used, freeing them
+    header->clean = 0;
+
+    mutex_lock(&snapshot_blocks_lock);
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        bool taken = free_blocks[i / BITMAP_WORD_BITS] &
+                     ((uint64_t)1 << (i % BITMAP_WORD_BITS));
+        blocks[i] = taken ? SNAPSHOT_BLOCK_PENDING : SNAPSHOT_BLOCK_DONE;
+    }
+    snapshot_blocks = blocks;
+    snapshot_fd = fd;
+    snapshot_failed = false;
+    atomic_store_explicit(&snapshot_running, true, memory_order_release);
+    mutex_unlock(&snapshot_blocks_lock);
+
+    rwl_unlock(&snapshot_lock);
+    atomic_store_explicit(&snapshot_flipping, false, memory_order_relaxed);
+    mutex_unlock(&snapshot_flip_lock);
+
+    // Streams the snapshot to its file
+    int ret = 0;
+    if (pwrite(fd, metadata, image_data_offset, 0) !=
+        (ssize_t)image_data_offset) {
+        ret = -1;
+    }
+    free(metadata);
+
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        if (snapshot_block_claim((int)i)) {
+            snapshot_block_copy((int)i);
+        }
+    }
+
+    mutex_lock(&snapshot_blocks_lock);
+    // (released, so that changes skipping the snapshot follow its copies)
+    atomic_store_explicit(&snapshot_running, false, memory_order_release);
+    snapshot_blocks = NULL;
+    if (snapshot_failed) {
+        ret = -1;
+    }
+    mutex_unlock(&snapshot_blocks_lock);
+    free(blocks);
+
+    if (fdatasync(fd) == -1) {
+        ret = -1;
+    }
+    if (close(fd) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Obtain a pointer to the contents of a given block, to read them.
+ * The block stays in memory (if it's cached) until it's released with
+ * data_block_put.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void *data_block_get(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_get: invalid block number");
+
+    if (fs_data == NULL) {
+        // only the blocks that miss the cache are read from storage
+        return block_cache_get(block_number, false);
+    }
+
+    insert_delay(TFS_ACCESS_BLOCK); // simulate storage access delay
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+}
+
+/**
+ * Obtain a pointer to the contents of a given block, to change them.
+ * Once changed, the block must be marked with data_block_edited (before its
+ * updates are logged in the journal), and then released with data_block_put.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void *data_block_edit(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_edit: invalid block number");
+
+    // the snapshot being taken (if any) keeps the block as it was
+    if (atomic_load_explicit(&snapshot_running, memory_order_acquire)) {
+        snapshot_block_save(block_number);
+    }
+
+    if (fs_data == NULL) {
+        return block_cache_get(block_number, true);
+    }
+
+    insert_delay(TFS_ACCESS_BLOCK); // simulate storage access delay
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+}
+
+/**
+ * Obtain a pointer to the contents of a given block, to read them through a
+ * lease. The block stays in memory (if it's cached) until it's released with
+ * data_block_lease_put.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns a pointer to the first byte of the block, or NULL if the cache has
+ * no room left for more leased blocks.
+ */
+void const *data_block_lease(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_lease: invalid block number");
+
+    if (fs_data == NULL) {
+        return block_cache_lease(block_number);
+    }
+
+    insert_delay(TFS_ACCESS_BLOCK); // simulate storage access delay
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+}
+
+/**
+ * Mark a block obtained with data_block_edit as changed.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void data_block_edited(void const *addr) { block_cache_edited(addr); }
+
+/**
+ * Release a block obtained with data_block_get or data_block_edit.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void data_block_put(void const *addr) { block_cache_put(addr); }
+
+/**
+ * Release a block obtained with data_block_lease.
+ *
+ * Input:
+ *   - addr: an address in the block
+ */
+void data_block_lease_put(void const *addr) { block_cache_lease_put(addr); }
+
+/**
+ * Log an update to a range of a data block (made by the caller, and marked
+ * with data_block_edited) in the journal.
+ *
+ * Input:
+ *   - addr: start of the range
+ *   - len: length of the range
+ */
+static void image_journal(void const *addr, size_t len) {
+    ssize_t offset = block_cache_offset(addr);
+    if (offset == -1) {
+        journal_log(addr, len); // mapped
+    } else {
+        journal_log_at((size_t)offset, addr, len);
+    }
+}
+
+/**
+ * Obtain a pointer to a block filled with zeros, the contents of the blocks of
+ * a file that were never written.
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void const *data_block_zeros(void) { return zero_block; }
+
+/**
+ * Add a new entry to the open file table.
+ *
+ * The entry's slot is claimed with a compare-and-swap on its state, so opening
+ * a file doesn't serialize with other opens, closes, reads or writes.
+ *
+ * Input:
+ *   - inumber: inode number of the file to open
+ *   - offset: initial offset
+ *
+ * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-    mutex_lock(&free_open_file_entries_lock);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            mutex_lock(&open_file_table[i].lock);
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            mutex_unlock(&open_file_table[i].lock);
-            mutex_unlock(&free_open_file_entries_lock);
-            return i;
-            /* We can unlock the free open file entry table before the return,
-            since the only way this function could be returning something wrong,
-            would be if the user was opening a file and deleting it at the same
-            time, which is impossible, because we need the fhandle to close the
-            file and that's provided by this function */
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        unsigned state = atomic_load_explicit(&open_file_table[i].of_state,
+                                              memory_order_acquire);
+        if ((state & OPEN_FILE_TAKEN) ||
+            !atomic_compare_exchange_strong_explicit(
+                &open_file_table[i].of_state, &state, state | OPEN_FILE_TAKEN,
+                memory_order_acq_rel, memory_order_relaxed)) {
+            continue; // taken (possibly by a concurrent open)
         }
+
+        mutex_lock(&open_file_table[i].lock);
+        // (also read without the lock, by open_file_inumber)
+        __atomic_store_n(&open_file_table[i].of_inumber, inumber,
+                         __ATOMIC_RELEASE);
+        open_file_table[i].of_offset = offset;
+        mutex_unlock(&open_file_table[i].lock);
+
+        // No one else can have this handle until it's returned, and the
+        // handles of previous opens of this slot have another generation
+        return file_handle_make(i, state | OPEN_FILE_TAKEN);
     }
 
-    mutex_unlock(&free_open_file_entries_lock);
     return -1;
 }
 
 /**
- * Free an entry from the open file table.
+ * Free an entry from the open file table, so that its handle is no longer
+ * valid.
+ *
+ * Must be called with the entry's lock held (as returned by
+ * get_open_file_entry).
  *
  * Input:
  *   - fhandle: file handle to free/close
@@ -537,33 +2632,85 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(valid_file_handle(fhandle),
                   "remove_from_open_file_table: file handle must be valid");
 
-    mutex_lock(&open_file_table[fhandle].lock);
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
+    size_t slot = file_handle_slot(fhandle);
+    unsigned state = atomic_load_explicit(&open_file_table[slot].of_state,
+                                          memory_order_relaxed);
+    ALWAYS_ASSERT(file_handle_make(slot, state) == fhandle,
                   "remove_from_open_file_table: file handle must be taken");
 
-    free_open_file_entries[fhandle] = FREE;
-    mutex_unlock(&open_file_table[fhandle].lock);
+    // Moves on to the next generation, with the slot free
+    atomic_store_explicit(&open_file_table[slot].of_state,
+                          (state | OPEN_FILE_TAKEN) + 1, memory_order_release);
 }
 
 /**
- * Obtain pointer to a given entry in the open file table.
+ * Obtain pointer to a given entry in the open file table, locking it.
+ *
+ * The handle is checked without any global lock, and checked again once the
+ * entry is locked, since it may have been closed in the meantime.
  *
  * Input:
  *   - fhandle: file handle
  *
- * Returns pointer to the entry, or NULL if the fhandle is invalid/closed/never
- * opened.
+ * Returns pointer to the entry (with its lock held), or NULL if the fhandle is
+ * invalid/closed/never opened.
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
-        return NULL;
+    size_t slot = file_handle_slot(fhandle);
+    if (file_handle_make(slot,
+                         atomic_load_explicit(&open_file_table[slot].of_state,
+                                              memory_order_acquire)) !=
+        fhandle) {
+        return NULL; // closed, or a stale handle
+    }
+
+    open_file_entry_t *file = &open_file_table[slot];
+    mutex_lock(&file->lock);
+    if (file_handle_make(slot,
+                         atomic_load_explicit(&open_file_table[slot].of_state,
+                                              memory_order_acquire)) !=
+        fhandle) {
+        mutex_unlock(&file->lock);
+        return NULL; // closed in the meantime
+    }
+
+    return file;
+}
+
+/**
+ * Find the inode of an open file, without locking its entry.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns the inumber of the file, or -1 if the handle isn't open.
+ */
+int open_file_inumber(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
+
+    size_t slot = file_handle_slot(fhandle);
+    unsigned state = atomic_load_explicit(&open_file_table[slot].of_state,
+                                          memory_order_acquire);
+    if (file_handle_make(slot, state) != fhandle) {
+        return -1; // closed, or a stale handle
     }
 
-    return &open_file_table[fhandle];
+    // the slot may have been reused in the meantime, with another inumber
+    // (which, being acquired, isn't read after the state is checked again)
+    int inumber =
+        __atomic_load_n(&open_file_table[slot].of_inumber, __ATOMIC_ACQUIRE);
+    if (atomic_load_explicit(&open_file_table[slot].of_state,
+                             memory_order_relaxed) != state) {
+        return -1; // closed in the meantime
+    }
+
+    return inumber;
 }
 
 /**
@@ -578,7 +2725,9 @@ int is_file_opened(int inumber) {
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         mutex_lock(&open_file_table[i].lock);
         if (open_file_table[i].of_inumber == inumber &&
-            free_open_file_entries[i] == TAKEN) {
+            (atomic_load_explicit(&open_file_table[i].of_state,
+                                  memory_order_acquire) &
+             OPEN_FILE_TAKEN)) {
             mutex_unlock(&open_file_table[i].lock);
             return 0;
         }
@@ -588,25 +2737,9 @@ int is_file_opened(int inumber) {
     return -1;
 }
 
-/*
- * Get the free open file entries lock
- *
- * Returns the lock
- */
-pthread_mutex_t *get_free_open_file_entries_lock() {
-    return &free_open_file_entries_lock;
-}
-
-/*
- * Get the free blocks' lock
- *
- * Returns the lock
- */
-pthread_mutex_t *get_free_blocks_lock() { return &free_blocks_lock; }
-
 /*
  * Get the inode locks table
  *
  * Returns a pointer to the table
  */
-pthread_rwlock_t *get_inode_locks() { return inode_locks; }
+inode_sync_t *get_inode_syncs() { return inode_syncs; }
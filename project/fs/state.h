@@ -5,6 +5,8 @@
 #include "operations.h"
 
 #include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,50 +27,131 @@ typedef enum { T_FILE, T_DIRECTORY, T_SYM_LINK } inode_type;
  */
 typedef struct {
     inode_type i_node_type;
+    // whether the file's data is kept in the inode itself, instead of in data
+    // blocks; files start this way, until they outgrow INODE_INLINE_SIZE
+    bool i_inline;
 
     size_t i_size;
-    int i_data_block;
+    union {
+        struct {
+            // block numbers of the first INODE_DIRECT_BLOCKS blocks of the file
+            int i_direct_blocks[INODE_DIRECT_BLOCKS];
+            // block holding the block numbers of the following blocks
+            int i_indirect_block;
+            // block holding the numbers of further indirect blocks
+            int i_double_indirect_block;
+        };
+        // data of an inline file
+        char i_inline_data[INODE_INLINE_SIZE];
+    };
     int hard_links;
 
+    // if not 0, the file is a ring of this many bytes: the byte at each offset
+    // is stored at that offset modulo i_ring_capacity, so writes wrap around
+    // and overwrite the oldest bytes, which are then gone
+    size_t i_ring_capacity;
+    // offset of the oldest byte still in a ring file (0 otherwise)
+    size_t i_ring_head;
+
     // in a more complete FS, more fields could exist here
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
 /**
- * Open file entry (in open file table)
+ * Synchronization state of an inode (only kept in memory), alone in its cache
+ * line, so that threads using different files don't contend for it.
+ * This is all of an inode's state that's written by every access to it; the
+ * inode itself (inode_t) holds its cold metadata, only written when the file
+ * changes, under the lock, and kept apart from this in the inode table.
+ */
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+    // sequence counter of the inode's size and number of links, odd while
+    // they're being changed, so they can be read without locking (seqlock)
+    atomic_uint seq;
+    // number of read leases on the inode's blocks, which aren't freed while
+    // there's any
+    atomic_uint leases;
+    // number of open file handles and leases on the inode, plus INODE_ORPHAN
+    // once it's unlinked while there's any; it's deleted when they're all gone
+    atomic_uint refs;
+    // for a symlink, the file its chain of symlinks was last resolved to, and
+    // the namespace generation it's valid for (see symlink_cache_get)
+    atomic_uint_least64_t symlink_target;
+} inode_sync_t;
+
+#define INODE_ORPHAN (1u << 31)
+
+/**
+ * Open file entry (in open file table), alone in its cache line
  */
 typedef struct {
-    int of_inumber;
+    alignas(CACHE_LINE_SIZE) int of_inumber;
     size_t of_offset;
+    // generation of the entry's slot (shifted left by one) and whether it's
+    // taken (see add_to_open_file_table)
+    atomic_uint of_state;
 
     pthread_mutex_t lock;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
+void state_change_begin(void);
+void state_change_end(void);
+int state_snapshot(char const *path);
 
 size_t state_block_size(void);
+size_t state_max_file_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+int inode_block_get(inode_t const *inode, size_t block_index);
+int inode_block_alloc(inode_t *inode, size_t block_index);
+void inode_truncate(inode_t *inode);
+int inode_inline_promote(inode_t *inode);
+void inode_clone(inode_t *clone, inode_t const *source);
+void inode_journal(inode_t const *inode);
+void inode_ref_get(int inumber);
+bool inode_ref_put(int inumber);
+bool inode_unlinked(int inumber);
+void inode_lease_get(int inumber);
+bool inode_lease_put(int inumber);
+void inode_size_set(inode_t *inode, size_t size);
+void inode_extent_set(inode_t *inode, size_t head, size_t size);
+void inode_links_set(inode_t *inode, int hard_links);
+void inode_stat(int inumber, size_t *head, size_t *size, int *hard_links);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_for_each(inode_t const *inode,
+                 void (*callback)(char const *name, int inumber, void *arg),
+                 void *arg);
+void namespace_changed(void);
+int symlink_cache_get(int inumber, unsigned *generation);
+void symlink_cache_set(int inumber, int target, unsigned generation);
 
 int data_block_alloc(void);
+void data_block_ref(int block_number);
+uint32_t data_block_unref(int block_number);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
+void *data_block_edit(int block_number);
+void const *data_block_lease(int block_number);
+void data_block_edited(void const *addr);
+void data_block_put(void const *addr);
+void data_block_lease_put(void const *addr);
+void const *data_block_zeros(void);
 
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+int open_file_inumber(int fhandle);
 int is_file_opened(int inumber);
 
-pthread_mutex_t *get_free_open_file_entries_lock();
-pthread_mutex_t *get_free_blocks_lock();
-pthread_rwlock_t *get_inode_locks();
+inode_sync_t *get_inode_syncs();
 
 #endif // STATE_H
@@ -1,5 +1,6 @@
 #include "mbroker.h"
 #include "common.h"
+#include "config.h"
 #include "locks.h"
 #include "logging.h"
 #include "operations.h"
@@ -7,15 +8,29 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* Maximum number of messages read from a publisher's pipe (and stored in its
+ * box) at once */
+#define PUB_MSG_BATCH 16
+
+/* Number of bytes read from a box at once, for a subscriber, in units of
+ * MSG_MAX_SIZE */
+#define SUB_READ_BATCH 16
+
 /* Boxes and respective locks */
 static box_t boxes[MAX_N_BOXES];
 static pthread_mutex_t boxes_locks[MAX_N_BOXES];
@@ -23,12 +38,29 @@ static int free_boxes[MAX_N_BOXES];
 static pthread_mutex_t free_boxes_lock;
 static pthread_cond_t boxes_cond_vars[MAX_N_BOXES];
 
+/* TFS file handle of each box, kept open while the box exists and shared by
+ * its publisher and subscribers, each with its own offset */
+static int box_fhandles[MAX_N_BOXES];
+
+/* Whether a thread using the TFS (a worker or the snapshot thread) is in a
+ * TFS call, so that the TFS is only destroyed (writing its image back) once
+ * none is; each thread has its own, in its own cache line, so that the calls
+ * don't contend with each other */
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_bool in_call;
+} tfs_user_t;
+
+static tfs_user_t *tfs_users;
+static atomic_size_t tfs_users_count;
+static _Thread_local tfs_user_t *tfs_user; // the calling thread's
+static atomic_bool tfs_closing;            // set once the TFS is destroyed
+
 /* Variable to know whether mbroker should be shutdown */
 static int shutdown_mbroker = 0;
 
 void sigint_handler() { shutdown_mbroker = 1; }
 
-// argv[1] = register_pipe, argv[2] = max_sessions
+// argv[1] = register_pipe, argv[2] = max_sessions, argv[3] = tfs_image
 int main(int argc, char **argv) {
 
     if (signal(SIGINT, sigint_handler) == SIG_ERR) {
@@ -39,21 +71,42 @@ int main(int argc, char **argv) {
         PANIC("couldn't set signal handler")
     }
 
+    // SIGUSR1 is only received through sigwait, by the snapshot thread
+    sigset_t snapshot_signals;
+    sigemptyset(&snapshot_signals);
+    sigaddset(&snapshot_signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL) != 0) {
+        PANIC("couldn't block SIGUSR1")
+    }
+
     if (argc == 2 && !strcmp(argv[1], "--help")) {
-        printf("usage: ./mbroker <pipename> <max_sessions>\n");
+        printf("usage: ./mbroker <pipename> <max_sessions> [tfs_image]\n");
         return 0;
     }
 
     size_t max_sessions;
 
-    if (argc != 3 || sscanf(argv[2], "%ld", &max_sessions) == 0) {
+    if ((argc != 3 && argc != 4) ||
+        sscanf(argv[2], "%ld", &max_sessions) == 0) {
         fprintf(stderr, "mbroker: Invalid arguments.\nTry './mbroker --help'"
                         " for more information.\n");
         exit(EXIT_FAILURE);
     }
 
-    // Init the file system
-    if (tfs_init(NULL) == -1) {
+    // Init the file system, with enough data blocks for every box to fill its
+    // BOX_SIZE ring, counting the indirect blocks needed to address them
+    tfs_params params = tfs_default_params();
+    size_t box_blocks = BOX_SIZE / params.block_size;
+    size_t box_indirect_blocks =
+        box_blocks / (params.block_size / sizeof(int)) + 2;
+    params.max_block_count =
+        MAX_N_BOXES * (box_blocks + box_indirect_blocks) + 1;
+    // Only the boxes hold open files, one each
+    params.max_open_files_count = MAX_N_BOXES;
+    // The boxes outlive the mbroker if they're kept in an image file
+    params.image_path = argc == 4 ? argv[3] : NULL;
+
+    if (tfs_init(&params) == -1) {
         PANIC("tfs_init failed")
     }
 
@@ -70,6 +123,31 @@ int main(int argc, char **argv) {
     for (int i = 0; i < MAX_N_BOXES; i++)
         cond_init(&boxes_cond_vars[i]);
 
+    // The workers and the snapshot thread
+    tfs_users = aligned_alloc(CACHE_LINE_SIZE,
+                              (max_sessions + 1) * sizeof(tfs_user_t));
+    if (tfs_users == NULL) {
+        PANIC("couldn't allocate the TFS users")
+    }
+    for (size_t i = 0; i < max_sessions + 1; i++) {
+        atomic_init(&tfs_users[i].in_call, false);
+    }
+
+    // Restore the boxes left in the TFS image by a previous run
+    if (tfs_list(box_restore, NULL) == -1) {
+        PANIC("tfs_list failed")
+    }
+    for (int i = 0; i < MAX_N_BOXES; i++) {
+        if (free_boxes[i] == 0 &&
+            (box_fhandles[i] = tfs_open(boxes[i].box_name, 0)) == -1) {
+            PANIC("tfs_open failed")
+        }
+        // An empty file that isn't a ring yet becomes one (it fails otherwise)
+        if (free_boxes[i] == 0) {
+            tfs_make_ring(box_fhandles[i], BOX_SIZE);
+        }
+    }
+
     // Set log level
     set_log_level(LOG_VERBOSE);
 
@@ -85,6 +163,19 @@ int main(int argc, char **argv) {
     for (int i = 0; i < max_sessions; i++)
         pthread_create(&tid[i], NULL, handle_registration, &queue);
 
+    // The boxes can be backed up without stopping the mbroker, by sending it
+    // SIGUSR1, if they're kept in an image file
+    char snapshot_path[PATH_MAX];
+    if (argc == 4) {
+        pthread_t snapshot_tid;
+        snprintf(snapshot_path, sizeof(snapshot_path), "%s.snapshot", argv[3]);
+        if (pthread_create(&snapshot_tid, NULL, snapshot_handler,
+                           snapshot_path) != 0) {
+            PANIC("couldn't create the snapshot thread")
+        }
+        pthread_detach(snapshot_tid);
+    }
+
     int register_pipe_fd, aux_reg_pipe_fd = 0;
 
     // Remove pipe if it exists
@@ -185,7 +276,21 @@ int main(int argc, char **argv) {
         }
     }
 
-    /* In this section we should destroy TFS, pcq (and free queued
+    // Wait for the TFS calls in progress (no more are started), and destroy it
+    // so that its image (if any) is written back and marked as cleanly shut
+    // down
+    atomic_store(&tfs_closing, true);
+    size_t users_count = atomic_load(&tfs_users_count);
+    for (size_t i = 0; i < users_count; i++) {
+        while (atomic_load(&tfs_users[i].in_call)) {
+            sched_yield();
+        }
+    }
+    if (tfs_destroy() == -1) {
+        WARN("tfs_destroy failed")
+    }
+
+    /* In this section we should also destroy pcq (and free queued
     registrations), locks, cond vars and exit threads, but due to problems with
     destroying locks, which are caused by threads that are holding the lock at
     the time of its destruction, we chose not to do it, since it's not a
@@ -210,6 +315,49 @@ int main(int argc, char **argv) {
     return 0;
 }
 
+void *snapshot_handler(void *snapshot_path) {
+    sigset_t snapshot_signals;
+    sigemptyset(&snapshot_signals);
+    sigaddset(&snapshot_signals, SIGUSR1);
+
+    while (1) {
+        int signal_number;
+        if (sigwait(&snapshot_signals, &signal_number) != 0) {
+            WARN("sigwait failed")
+            continue;
+        }
+
+        // The snapshot is streamed while the other workers keep using the
+        // tfs, which isn't destroyed meanwhile
+        tfs_call_begin();
+        if (tfs_snapshot(snapshot_path) == -1) {
+            WARN("couldn't take a snapshot to %s", (char *)snapshot_path)
+        } else {
+            LOG("took a snapshot to %s", (char *)snapshot_path)
+        }
+        tfs_call_end();
+    }
+}
+
+void tfs_call_begin(void) {
+    if (tfs_user == NULL) {
+        tfs_user = &tfs_users[atomic_fetch_add(&tfs_users_count, 1)];
+    }
+
+    atomic_store(&tfs_user->in_call, true);
+    if (atomic_load(&tfs_closing)) {
+        // The mbroker is shutting down, and this thread goes no further
+        atomic_store(&tfs_user->in_call, false);
+        while (1) {
+            pause();
+        }
+    }
+}
+
+void tfs_call_end(void) {
+    atomic_store_explicit(&tfs_user->in_call, false, memory_order_release);
+}
+
 int box_lookup(const char *box_name) {
     for (int i = 0; i < MAX_N_BOXES; i++) {
         mutex_lock(&boxes_locks[i]);
@@ -284,7 +432,7 @@ void *handle_registration(void *q) {
 }
 
 void pub_connect(char *pub_pipe_path, char *box_name) {
-    int pub_pipe_fd, box_fd;
+    int pub_pipe_fd;
 
     // Open the pub_pipe for reading
     if ((pub_pipe_fd = open(pub_pipe_path, O_RDONLY)) == -1) {
@@ -314,18 +462,6 @@ void pub_connect(char *pub_pipe_path, char *box_name) {
 
     box_t *box = &boxes[i_box];
 
-    // Check if box is full
-    if (box->box_size == BOX_SIZE) {
-        INFO("box %s is full", box_name)
-        mutex_unlock(&boxes_locks[i_box]);
-
-        // Close the pub pipe
-        if (close(pub_pipe_fd) == -1) {
-            PANIC("close failed: %s", strerror(errno))
-        }
-        return;
-    }
-
     // Check if there's no pub already in the given box
     if (box->n_publishers == 1) {
         INFO("there's already a pub in box %s", box_name)
@@ -341,28 +477,20 @@ void pub_connect(char *pub_pipe_path, char *box_name) {
     box->n_publishers = 1;
     mutex_unlock(&boxes_locks[i_box]);
 
-    // Open the box to write the messages
-    if ((box_fd = tfs_open(box_name, TFS_O_APPEND)) == -1) {
-        WARN("tfs_open failed")
-
-        mutex_lock(&boxes_locks[i_box]);
-        box->n_publishers = 0;
-        mutex_unlock(&boxes_locks[i_box]);
-
-        if (close(pub_pipe_fd) == -1) {
-            PANIC("close failed: %s", strerror(errno))
-        }
-
-        return;
-    }
-
     ssize_t ret;
-    char buffer[PUB_MSG_SIZE];
-    char msg[MSG_MAX_SIZE];
+    size_t const msg_size = (size_t)(PUB_MSG_SIZE);
+    // Messages are read in batches of up to PUB_MSG_BATCH, so a burst of them
+    // is stored at once; the last one read may be incomplete, its first
+    // `filled` bytes are kept at the start of the buffer until the rest of it
+    // is read
+    char buffer[PUB_MSG_BATCH * (PUB_MSG_SIZE)];
+    size_t filled = 0;
+    struct iovec msgs[PUB_MSG_BATCH];
+    int end_session = 0;
 
     // Read incoming messages until pub closes its pipe
-    while (1) {
-        ret = read(pub_pipe_fd, buffer, PUB_MSG_SIZE);
+    while (!end_session) {
+        ret = read(pub_pipe_fd, buffer + filled, sizeof(buffer) - filled);
 
         if (ret == 0) {
             // ret == 0 indicates EOF, pub ended session
@@ -372,13 +500,25 @@ void pub_connect(char *pub_pipe_path, char *box_name) {
             PANIC("read failed: %s", strerror(errno))
         }
 
-        // Verify code
-        if (buffer[0] != OPCODE_PUB_MSG) {
-            PANIC("Internal error: Invalid OP_CODE!")
+        filled += (size_t)ret;
+        size_t n_msgs = filled / msg_size;
+        if (n_msgs == 0) {
+            continue;
         }
 
-        // Copy only the msg itself
-        strcpy(msg, buffer + OPCODE_SIZE);
+        for (size_t i = 0; i < n_msgs; i++) {
+            char *request = buffer + i * msg_size;
+
+            // Verify code
+            if (request[0] != OPCODE_PUB_MSG) {
+                PANIC("Internal error: Invalid OP_CODE!")
+            }
+
+            // Store only the msg itself
+            request[msg_size - 1] = '\0';
+            msgs[i].iov_base = request + OPCODE_SIZE;
+            msgs[i].iov_len = strlen(request + OPCODE_SIZE) + 1;
+        }
 
         mutex_lock(&free_boxes_lock);
         // Check if box has been deleted by a manager in the meantime
@@ -389,28 +529,33 @@ void pub_connect(char *pub_pipe_path, char *box_name) {
 
         mutex_lock(&boxes_locks[i_box]);
         mutex_unlock(&free_boxes_lock);
-        if ((ret = tfs_write(box_fd, msg, strlen(msg) + 1)) < strlen(msg) + 1) {
-            if (ret == -1) { // error
-                mutex_unlock(&boxes_locks[i_box]);
-                PANIC("tfs_write failed")
-            } else { // Couldn't write whole message
-                INFO("box %s is full", box_name)
-                // Signal subs that a new message was written
-                cond_broadcast(&boxes_cond_vars[i_box]);
-                box->box_size += (uint64_t)ret;
-                mutex_unlock(&boxes_locks[i_box]);
-                break;
-            }
+
+        size_t batch_size = 0;
+        for (size_t i = 0; i < n_msgs; i++) {
+            batch_size += msgs[i].iov_len;
         }
 
-        // Signal subs that a new message was written
+        // Messages are appended at the end of the box, a ring file that keeps
+        // the last BOX_SIZE bytes, overwriting the oldest messages
+        tfs_call_begin();
+        ret = tfs_pwritev(box_fhandles[i_box], msgs, (int)n_msgs,
+                          box->box_size);
+        tfs_call_end();
+        if (ret == -1) {
+            mutex_unlock(&boxes_locks[i_box]);
+            PANIC("tfs_pwritev failed")
+        } else if (ret < batch_size) { // Couldn't write every message
+            INFO("box %s is full", box_name)
+            end_session = 1;
+        }
+
+        // Signal subs that new messages were written
         cond_broadcast(&boxes_cond_vars[i_box]);
         box->box_size += (uint64_t)ret;
         mutex_unlock(&boxes_locks[i_box]);
-    }
 
-    if (tfs_close(box_fd) == -1) {
-        PANIC("tfs_close failed")
+        filled -= n_msgs * msg_size;
+        memmove(buffer, buffer + n_msgs * msg_size, filled);
     }
 
     mutex_lock(&boxes_locks[i_box]);
@@ -457,25 +602,16 @@ void sub_connect(char *sub_pipe_path, char *box_name) {
     box->n_subscribers++;
     mutex_unlock(&boxes_locks[i_box]);
 
-    // Open the box to read the messages
-    if ((box_fd = tfs_open(box_name, 0)) == -1) {
-        WARN("tfs_open failed")
-
-        mutex_lock(&boxes_locks[i_box]);
-        box->n_subscribers--;
-        mutex_unlock(&boxes_locks[i_box]);
-
-        if (close(sub_pipe_fd) == -1) {
-            PANIC("close failed: %s", strerror(errno))
-        }
-
-        return;
-    }
-
-    ssize_t ret;
-    char buffer[MSG_MAX_SIZE + 1];
-    char response[PUB_MSG_SIZE];
-    response[0] = OPCODE_SUB_MSG;
+    // Offset of the next message to read from the box
+    size_t offset = 0;
+    // Messages are read from the box in batches of bytes; the last one read
+    // may be incomplete, its first `pending` bytes are kept at the start of
+    // the buffer until the rest of it is read
+    char buffer[SUB_READ_BATCH * MSG_MAX_SIZE];
+    size_t pending = 0;
+    // Whether the bytes read next may start in the middle of a message, so
+    // that they're skipped up to the start of the following one
+    int resync = 0;
     int end_session = 0;
 
     mutex_lock(&free_boxes_lock);
@@ -486,51 +622,90 @@ void sub_connect(char *sub_pipe_path, char *box_name) {
             break;
         }
 
-        mutex_lock(&boxes_locks[i_box]);
+        box_fd = box_fhandles[i_box];
         mutex_unlock(&free_boxes_lock);
-        // Read the messages from the box
-        if ((ret = tfs_read(box_fd, buffer, BOX_SIZE)) == -1) {
+        tfs_call_begin();
+        // Check for new messages without locking the box's file
+        tfs_stat_t stat;
+        if (tfs_stat(box_fd, &stat) == -1) {
+            tfs_call_end();
+            // The handle was closed, the box has been deleted in the meantime
+            break;
+        } else if (stat.size <= offset) {
+            tfs_call_end();
+            // Wait for a signal from a pub, checking again under the box's
+            // lock (which pubs write and signal under), so that a message
+            // published since isn't missed
+            mutex_lock(&boxes_locks[i_box]);
+            tfs_call_begin();
+            int ret = tfs_stat(box_fd, &stat);
+            tfs_call_end();
+            if (free_boxes[i_box] == 0 && ret != -1 && stat.size <= offset) {
+                cond_wait(&boxes_cond_vars[i_box], &boxes_locks[i_box]);
+            }
             mutex_unlock(&boxes_locks[i_box]);
-            PANIC("tfs_read failed")
+            mutex_lock(&free_boxes_lock);
+            continue;
         }
-        mutex_unlock(&boxes_locks[i_box]);
 
-        buffer[ret] = '\0';
-        size_t len;
-        char *ptr_buffer = buffer;
-        size_t _ret = (size_t)ret;
-        // Separate messages
-        while (_ret > 0) {
-            len = strlen(ptr_buffer);
-            strcpy(response + OPCODE_SIZE, ptr_buffer);
-            // if there was no '\0' at the end of the last message
-            if (_ret == len && ret != 0)
-                _ret++;
-            _ret -= len + 1;
-            // Send each message to sub
-            if (write(sub_pipe_fd, response, PUB_MSG_SIZE) < PUB_MSG_SIZE) {
-                if (errno == EPIPE) {
-                    end_session = 1;
-                    break;
-                } else {
-                    PANIC("write failed: %s", strerror(errno))
-                }
+        if (offset < stat.head) {
+            // The box wrapped around past the next messages, which are gone;
+            // the oldest one left may have lost its start (and, as that can't
+            // be told apart, is always dropped)
+            offset = stat.head;
+            pending = 0;
+            resync = 1;
+        }
+
+        // Copy the next messages out of the box (a pub may overwrite them as
+        // soon as the box's lock is released)
+        ssize_t ret = tfs_pread(box_fd, buffer + pending,
+                                sizeof(buffer) - pending, offset);
+        tfs_call_end();
+        if (ret == -1) {
+            // The box wrapped around past the offset meanwhile (or has been
+            // deleted, which is found out next)
+            mutex_lock(&free_boxes_lock);
+            continue;
+        }
+        offset += (size_t)ret;
+
+        char const *data = buffer;
+        size_t available = pending + (size_t)ret;
+        if (resync) {
+            char const *end = memchr(data, '\0', available);
+            size_t skipped = end != NULL ? (size_t)(end - data) + 1 : available;
+            data += skipped;
+            available -= skipped;
+            resync = end == NULL;
+        }
+
+        // Send the whole messages read, leaving the incomplete one (if any)
+        // pending; a message without '\0' filling MSG_MAX_SIZE is sent as is
+        while (!end_session && available > 0) {
+            size_t chunk = available < MSG_MAX_SIZE ? available : MSG_MAX_SIZE;
+            char const *end = memchr(data, '\0', chunk);
+            if (end != NULL) {
+                chunk = (size_t)(end - data) + 1;
+            } else if (chunk < MSG_MAX_SIZE) {
+                break;
             }
-            ptr_buffer += len + 1;
+
+            end_session = sub_send(sub_pipe_fd, data, chunk) == -1;
+            data += chunk;
+            available -= chunk;
         }
+        memmove(buffer, data, available);
+        pending = available;
 
         if (end_session)
             break;
 
-        // Wait for a signal from a pub
+        // There may be more messages in the box already, so keep reading
+        // before waiting for new ones
         mutex_lock(&free_boxes_lock);
-        cond_wait(&boxes_cond_vars[i_box], &free_boxes_lock);
     } while (1);
 
-    if (tfs_close(box_fd) == -1) {
-        PANIC("tfs_close failed")
-    }
-
     mutex_lock(&boxes_locks[i_box]);
     box->n_subscribers--;
     mutex_unlock(&boxes_locks[i_box]);
@@ -540,6 +715,26 @@ void sub_connect(char *sub_pipe_path, char *box_name) {
     }
 }
 
+int sub_send(int sub_pipe_fd, char const *msg, size_t len) {
+    static char const padding[MSG_MAX_SIZE] = {0};
+    uint8_t op_code = OPCODE_SUB_MSG;
+
+    // Every message is sent with the same size, in a single write
+    struct iovec response[] = {
+        {.iov_base = &op_code, .iov_len = (size_t)OPCODE_SIZE},
+        {.iov_base = (void *)msg, .iov_len = len},
+        {.iov_base = (void *)padding, .iov_len = MSG_MAX_SIZE - len},
+    };
+    if (writev(sub_pipe_fd, response, 3) < PUB_MSG_SIZE) {
+        if (errno == EPIPE) {
+            return -1;
+        }
+        PANIC("write failed: %s", strerror(errno))
+    }
+
+    return 0;
+}
+
 void box_creation(char *man_pipe_path, char *box_name) {
     int man_pipe_fd, box_fd;
 
@@ -570,13 +765,22 @@ void box_creation(char *man_pipe_path, char *box_name) {
         return_code = -1;
         strcpy(error_msg, "Box already exists.");
     } else {
-        // Create the box
-        if ((box_fd = tfs_open(box_name, TFS_O_CREAT)) == -1) {
+        // Create the box, a ring file that keeps its last BOX_SIZE bytes
+        tfs_call_begin();
+        box_fd = tfs_open(box_name, TFS_O_CREAT);
+        if (box_fd != -1 && tfs_make_ring(box_fd, BOX_SIZE) == -1) {
+            // The name was already taken by some file other than a box
+            tfs_close(box_fd);
+            box_fd = -1;
+        }
+        tfs_call_end();
+        if (box_fd == -1) {
             mutex_unlock(&free_boxes_lock);
             return_code = -1;
             strcpy(error_msg, "Couldn't create box.");
         } else {
-            for (int i = 0; i < MAX_N_BOXES; i++) {
+            int i;
+            for (i = 0; i < MAX_N_BOXES; i++) {
                 if (free_boxes[i] == 1) {
                     free_boxes[i] = 0;
 
@@ -588,17 +792,21 @@ void box_creation(char *man_pipe_path, char *box_name) {
 
                     mutex_lock(&boxes_locks[i]);
                     boxes[i] = new_box;
+                    // The box keeps its handle until it's removed
+                    box_fhandles[i] = box_fd;
                     mutex_unlock(&boxes_locks[i]);
                     break;
                 }
             }
             mutex_unlock(&free_boxes_lock);
-        }
 
-        if (box_fd != -1) {
-            if (tfs_close(box_fd) == -1) {
-                // Shouldn't happen
-                PANIC("Internal error: Box close failed!")
+            if (i == MAX_N_BOXES) {
+                tfs_call_begin();
+                if (tfs_close(box_fd) == -1) {
+                    // Shouldn't happen
+                    PANIC("Internal error: Box close failed!")
+                }
+                tfs_call_end();
             }
         }
     }
@@ -653,7 +861,7 @@ void box_removal(char *man_pipe_path, char *box_name) {
     // error message
     char error_msg[ERROR_MSG_SIZE] = {0};
 
-    int i_box;
+    int i_box, ret;
     mutex_lock(&free_boxes_lock);
     // Check if box doesn't exist
     if ((i_box = box_lookup(box_name)) == -1) {
@@ -661,9 +869,14 @@ void box_removal(char *man_pipe_path, char *box_name) {
         return_code = -1;
         strcpy(error_msg, "Box doesn't exist.");
     } else {
-        // Remove the box
+        // Remove the box's name only: its file stays around, for the
+        // subscribers still reading it, until its handle is closed
         mutex_lock(&boxes_locks[i_box]);
-        if (tfs_unlink(box_name) == -1) {
+        tfs_call_begin();
+        ret = tfs_unlink(box_name);
+        tfs_call_end();
+        int box_fd = box_fhandles[i_box];
+        if (ret == -1) {
             return_code = -1;
             strcpy(error_msg, "Couldn't remove box.");
         } else {
@@ -674,6 +887,17 @@ void box_removal(char *man_pipe_path, char *box_name) {
 
         mutex_unlock(&boxes_locks[i_box]);
         mutex_unlock(&free_boxes_lock);
+
+        // The file's blocks are freed by this close, without holding up the
+        // pubs and subs of other boxes
+        if (ret != -1) {
+            tfs_call_begin();
+            if (tfs_close(box_fd) == -1) {
+                // Shouldn't happen
+                PANIC("Internal error: Box close failed!")
+            }
+            tfs_call_end();
+        }
     }
 
     // Send the response
@@ -798,3 +1022,28 @@ void box_listing(char *man_pipe_path) {
         PANIC("close failed: %s", strerror(errno))
     }
 }
+
+void box_restore(char const *box_name, size_t box_size, void *arg) {
+    (void)arg;
+
+    if (strlen(box_name) > BOXNAME_SIZE - 1) {
+        WARN("file %s isn't a box, its name is too long", box_name)
+        return;
+    }
+
+    for (int i = 0; i < MAX_N_BOXES; i++) {
+        if (free_boxes[i] == 1) {
+            free_boxes[i] = 0;
+
+            strcpy(boxes[i].box_name, box_name);
+            boxes[i].box_size = box_size;
+            boxes[i].n_publishers = 0;
+            boxes[i].n_subscribers = 0;
+
+            LOG("restored box %s", box_name)
+            return;
+        }
+    }
+
+    WARN("box %s can't be restored, there are too many boxes", box_name)
+}
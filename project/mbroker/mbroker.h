@@ -3,6 +3,17 @@
 
 #include "producer-consumer.h"
 
+/* Starts a TFS call, in a thread other than the main one; if the mbroker is
+ * shutting down (and the TFS being destroyed), never returns
+ *
+ */
+void tfs_call_begin(void);
+
+/* Ends a TFS call started with tfs_call_begin
+ *
+ */
+void tfs_call_end(void);
+
 /* Searches for the given box
  * Input:
  *   - box_name: the box's name
@@ -11,6 +22,14 @@
  */
 int box_lookup(const char *box_name);
 
+/* Takes a snapshot of the tfs whenever the mbroker receives SIGUSR1 (which
+ * every thread must block), while it keeps serving
+ * Input:
+ *   - snapshot_path: the path of the file where the snapshot is written
+ *
+ */
+void *snapshot_handler(void *snapshot_path);
+
 /* Pops a registration from the given queue and processes it
  * Input:
  *   - queue: a pointer to the queue
@@ -38,6 +57,17 @@ void pub_connect(char *pub_pipe_path, char *box_name);
  */
 void sub_connect(char *sub_pipe_path, char *box_name);
 
+/* Sends a message to a subscriber
+ *
+ * Input:
+ *   - sub_pipe_fd: The pipe through which the message will be sent;
+ *   - msg: The message (not necessarily terminated by '\0');
+ *   - len: The length of the message, at most MSG_MAX_SIZE.
+ *
+ * Returns 0 if successful, -1 if the subscriber closed the pipe.
+ */
+int sub_send(int sub_pipe_fd, char const *msg, size_t len);
+
 /* Creates a box in the tfs with the given name and stores it in "boxes"
  *
  * Input:
@@ -67,4 +97,14 @@ void box_removal(char *man_pipe_path, char *box_name);
  */
 void box_listing(char *man_pipe_path);
 
+/* Restores a box stored in the tfs by a previous run into "boxes"
+ *
+ * Input:
+ *   - box_name: The name of the box;
+ *   - box_size: The size of the box;
+ *   - arg: Unused (tfs_list callback argument).
+ *
+ */
+void box_restore(char const *box_name, size_t box_size, void *arg);
+
 #endif
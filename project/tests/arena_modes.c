@@ -0,0 +1,60 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// The FS works the same whichever way its memory is committed, and can be
+// destroyed (and initialized again) while that memory is still being
+// prefaulted in the background
+
+#define BLOCK_COUNT (16 * 1024)
+#define FILE_LEN (8 * 1024)
+
+static tfs_arena_mode_t const modes[] = {TFS_ARENA_LAZY, TFS_ARENA_PREFAULT,
+                                         TFS_ARENA_HUGE};
+
+int main() {
+    static char data[FILE_LEN], buffer[FILE_LEN];
+    for (size_t i = 0; i < FILE_LEN; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.latency_model = TFS_LATENCY_NONE;
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+        params.arena_mode = modes[i];
+
+        // Right away, and then with a file written and read back
+        int ret = tfs_init(&params);
+        assert(ret != -1);
+        ret = tfs_destroy();
+        assert(ret != -1);
+
+        ret = tfs_init(&params);
+        assert(ret != -1);
+        int fhandle = tfs_open("/f", TFS_O_CREAT);
+        assert(fhandle != -1);
+        ssize_t written = tfs_write(fhandle, data, FILE_LEN);
+        assert(written == FILE_LEN);
+        ssize_t read = tfs_pread(fhandle, buffer, FILE_LEN, 0);
+        assert(read == FILE_LEN && memcmp(buffer, data, FILE_LEN) == 0);
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+        ret = tfs_destroy();
+        assert(ret != -1);
+
+        // A new FS has none of the old one's files
+        ret = tfs_init(&params);
+        assert(ret != -1);
+        fhandle = tfs_open("/f", 0);
+        assert(fhandle == -1);
+        ret = tfs_destroy();
+        assert(ret != -1);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "state.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Latency of data_block_alloc and data_block_free as the FS fills up: at each
+// fill level, a random taken block is freed and another one allocated, over
+// and over, so the free blocks end up scattered across the bitmap. With the
+// next-fit bitmap allocator, both should take about as long at 99% full as at
+// 1% full.
+
+#define BLOCK_COUNT (64 * 1024)
+#define ROUNDS (20000)
+
+static unsigned const fill_levels[] = {1, 50, 99}; // percent
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+/**
+ * Pseudo-random numbers (xorshift64), the same on every run.
+ */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print the mean and 99th percentile of some latencies (sorting them).
+ */
+static void print_latencies(char const *what, uint64_t *latencies) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < ROUNDS; i++) {
+        total += latencies[i];
+    }
+    qsort(latencies, ROUNDS, sizeof(*latencies), compare_u64);
+    printf("  %-5s mean %6.0f ns, p99 %6llu ns", what,
+           (double)total / ROUNDS,
+           (unsigned long long)latencies[ROUNDS * 99 / 100]);
+}
+
+int main() {
+    static int taken[BLOCK_COUNT];
+    static uint64_t alloc_ns[ROUNDS];
+    static uint64_t free_ns[ROUNDS];
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.latency_model = TFS_LATENCY_NONE;
+
+    for (size_t level = 0; level < sizeof(fill_levels) / sizeof(*fill_levels);
+         level++) {
+        int ret = tfs_init(&params);
+        assert(ret != -1);
+
+        // Fills the FS up to the level (the root directory has a block)
+        size_t taken_count = BLOCK_COUNT * fill_levels[level] / 100 - 1;
+        for (size_t i = 0; i < taken_count; i++) {
+            taken[i] = data_block_alloc();
+            assert(taken[i] != -1);
+        }
+
+        for (size_t i = 0; i < ROUNDS; i++) {
+            size_t victim = rng_next() % taken_count;
+
+            uint64_t start = now_ns();
+            uint32_t refs = data_block_unref(taken[victim]);
+            data_block_free(taken[victim]);
+            uint64_t freed = now_ns();
+            taken[victim] = data_block_alloc();
+            uint64_t end = now_ns();
+            assert(refs == 0 && taken[victim] != -1);
+
+            free_ns[i] = freed - start;
+            alloc_ns[i] = end - freed;
+        }
+
+        printf("%2u%% full:", fill_levels[level]);
+        print_latencies("alloc", alloc_ns);
+        print_latencies("free", free_ns);
+        printf("\n");
+
+        ret = tfs_destroy();
+        assert(ret != -1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// A clone starts with the contents of its source, and from then on writes to
+// either file (to a shared block, or past its end), truncating one, or
+// deleting it, leave the other as it was; the same goes for tiny files, whose
+// data is kept in their inode
+
+#define FILE_LEN (3000)
+#define TINY_LEN (20)
+
+static char original[FILE_LEN];
+
+/**
+ * Check that a file holds exactly len bytes of data.
+ */
+static void check_file(char const *path, char const *data, size_t len) {
+    static char buffer[2 * FILE_LEN];
+    int fhandle = tfs_open(path, 0);
+    assert(fhandle != -1);
+    ssize_t read = tfs_read(fhandle, buffer, sizeof(buffer));
+    assert(read == (ssize_t)len && memcmp(buffer, data, len) == 0);
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+static void pwrite_file(char const *path, char const *data, size_t len,
+                        size_t offset) {
+    int fhandle = tfs_open(path, 0);
+    assert(fhandle != -1);
+    ssize_t written = tfs_pwrite(fhandle, data, len, offset);
+    assert(written == (ssize_t)len);
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+int main() {
+    static char src_data[FILE_LEN + 100], dst_data[FILE_LEN];
+    for (size_t i = 0; i < FILE_LEN; i++) {
+        original[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int fhandle = tfs_open("/src", TFS_O_CREAT);
+    assert(fhandle != -1);
+    ssize_t written = tfs_write(fhandle, original, FILE_LEN);
+    assert(written == FILE_LEN);
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+
+    ret = tfs_clone("/src", "/dst");
+    assert(ret != -1);
+    ret = tfs_clone("/src", "/dst");
+    assert(ret == -1); // already exists
+    ret = tfs_clone("/none", "/other");
+    assert(ret == -1);
+    check_file("/dst", original, FILE_LEN);
+
+    // Writing the middle block of the clone copies only it
+    memcpy(dst_data, original, FILE_LEN);
+    memset(dst_data + 1500, 'D', 10);
+    pwrite_file("/dst", "DDDDDDDDDD", 10, 1500);
+    check_file("/dst", dst_data, FILE_LEN);
+    check_file("/src", original, FILE_LEN);
+
+    // Writing the source's first block, and past its end
+    memcpy(src_data, original, FILE_LEN);
+    memset(src_data, 'S', 10);
+    memset(src_data + FILE_LEN, 'S', 100);
+    pwrite_file("/src", src_data, 10, 0);
+    pwrite_file("/src", src_data + FILE_LEN, 100, FILE_LEN);
+    check_file("/src", src_data, FILE_LEN + 100);
+    check_file("/dst", dst_data, FILE_LEN);
+
+    // Truncating the clone, then deleting the source
+    ret = tfs_clone("/src", "/dst2");
+    assert(ret != -1);
+    fhandle = tfs_open("/dst2", TFS_O_TRUNC);
+    assert(fhandle != -1);
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    check_file("/src", src_data, FILE_LEN + 100);
+
+    ret = tfs_unlink("/src");
+    assert(ret != -1);
+    check_file("/dst", dst_data, FILE_LEN);
+    check_file("/dst2", "", 0);
+
+    // A tiny file and its clone
+    fhandle = tfs_open("/tiny", TFS_O_CREAT);
+    assert(fhandle != -1);
+    written = tfs_write(fhandle, original, TINY_LEN);
+    assert(written == TINY_LEN);
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_clone("/tiny", "/tiny2");
+    assert(ret != -1);
+    memcpy(dst_data, original, TINY_LEN);
+    dst_data[0] = 'T';
+    pwrite_file("/tiny2", dst_data, 1, 0);
+    check_file("/tiny", original, TINY_LEN);
+    ret = tfs_unlink("/tiny");
+    assert(ret != -1);
+    check_file("/tiny2", dst_data, TINY_LEN);
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
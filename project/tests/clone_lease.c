@@ -0,0 +1,74 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// A lease taken through a clone keeps its block, shared with the source, even
+// once the clone has written its own copy of the block and the source has been
+// deleted (freeing its blocks for other files to reuse)
+
+#define FILE_LEN (3000)
+#define LEASE_OFFSET (1100)
+
+static char original[FILE_LEN];
+static char changed[FILE_LEN];
+static char filler[FILE_LEN];
+
+static void write_file(char const *path, char const *data) {
+    int fhandle = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fhandle != -1);
+    ssize_t written = tfs_write(fhandle, data, FILE_LEN);
+    assert(written == FILE_LEN);
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+int main() {
+    memset(original, 'o', FILE_LEN);
+    memset(changed, 'c', FILE_LEN);
+    memset(filler, 'f', FILE_LEN);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 16;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    write_file("/src", original);
+    ret = tfs_clone("/src", "/dst");
+    assert(ret != -1);
+
+    int fhandle = tfs_open("/dst", 0);
+    assert(fhandle != -1);
+    tfs_lease_t lease;
+    ret = tfs_read_lease(fhandle, &lease, FILE_LEN, LEASE_OFFSET);
+    assert(ret == 0 && lease.len > 0);
+
+    // The clone gets its own blocks, and the source's are freed and reused
+    ssize_t written = tfs_pwrite(fhandle, changed, FILE_LEN, 0);
+    assert(written == FILE_LEN);
+    ret = tfs_unlink("/src");
+    assert(ret != -1);
+    write_file("/filler1", filler);
+    write_file("/filler2", filler);
+
+    assert(memcmp(lease.data, original + LEASE_OFFSET, lease.len) == 0);
+
+    char buffer[FILE_LEN];
+    ssize_t read = tfs_pread(fhandle, buffer, FILE_LEN, 0);
+    assert(read == FILE_LEN && memcmp(buffer, changed, FILE_LEN) == 0);
+
+    ret = tfs_release_lease(&lease);
+    assert(ret == 0);
+
+    // Once released, the leased block is free again
+    write_file("/filler3", filler);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
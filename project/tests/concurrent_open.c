@@ -0,0 +1,104 @@
+#include "operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// Threads opening existing files (under the shared root directory lock) find
+// them, with their contents, while another thread keeps creating, truncating
+// and deleting files next to them
+
+#define READER_COUNT (4)
+#define ROUNDS (300)
+
+static char const *const paths[READER_COUNT] = {"/r0", "/r1", "/r2", "/r3"};
+
+static void *reader(void *arg) {
+    char const *path = arg;
+    char buffer[MAX_FILE_NAME];
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        int fhandle = tfs_open(path, 0);
+        assert(fhandle != -1);
+        ssize_t read = tfs_read(fhandle, buffer, sizeof(buffer));
+        assert(read == (ssize_t)strlen(path));
+        assert(memcmp(buffer, path, strlen(path)) == 0);
+        int ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+
+    return NULL;
+}
+
+static void *creator(void *arg) {
+    (void)arg;
+    char path[MAX_FILE_NAME];
+    char buffer[MAX_FILE_NAME];
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        int len = snprintf(path, sizeof(path), "/c%zu", i % 8);
+        assert(len > 0);
+
+        int fhandle = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fhandle != -1);
+        ssize_t written = tfs_write(fhandle, path, (size_t)len);
+        assert(written == len);
+        int ret = tfs_close(fhandle);
+        assert(ret != -1);
+
+        // Found right away by a plain open
+        fhandle = tfs_open(path, 0);
+        assert(fhandle != -1);
+        ssize_t read = tfs_read(fhandle, buffer, sizeof(buffer));
+        assert(read == len && memcmp(buffer, path, (size_t)len) == 0);
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+
+        if (i % 3 == 0) {
+            ret = tfs_unlink(path);
+            assert(ret != -1);
+            fhandle = tfs_open(path, 0);
+            assert(fhandle == -1);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    for (size_t i = 0; i < READER_COUNT; i++) {
+        int fhandle = tfs_open(paths[i], TFS_O_CREAT);
+        assert(fhandle != -1);
+        ssize_t written = tfs_write(fhandle, paths[i], strlen(paths[i]));
+        assert(written == (ssize_t)strlen(paths[i]));
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+
+    pthread_t creator_tid;
+    pthread_t reader_tids[READER_COUNT];
+    ret = pthread_create(&creator_tid, NULL, creator, NULL);
+    assert(ret == 0);
+    for (size_t i = 0; i < READER_COUNT; i++) {
+        ret = pthread_create(&reader_tids[i], NULL, reader, (void *)paths[i]);
+        assert(ret == 0);
+    }
+    for (size_t i = 0; i < READER_COUNT; i++) {
+        ret = pthread_join(reader_tids[i], NULL);
+        assert(ret == 0);
+    }
+    ret = pthread_join(creator_tid, NULL);
+    assert(ret == 0);
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
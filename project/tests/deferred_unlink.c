@@ -0,0 +1,68 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// A file deleted while open loses its name at once (which a new file can then
+// take), but can still be read and written through its handle, and keeps its
+// blocks until that handle is closed
+
+#define FILE_LEN (4000)
+
+int main() {
+    static char data[FILE_LEN], other[FILE_LEN], buffer[FILE_LEN];
+    memset(data, 'd', FILE_LEN);
+    memset(other, 'o', FILE_LEN);
+
+    // Room for the root directory and a bit less than two files' blocks
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 8;
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int orphan = tfs_open("/f", TFS_O_CREAT);
+    assert(orphan != -1);
+    ssize_t written = tfs_write(orphan, data, FILE_LEN - 1);
+    assert(written == FILE_LEN - 1);
+
+    ret = tfs_unlink("/f");
+    assert(ret != -1);
+    int fhandle = tfs_open("/f", 0);
+    assert(fhandle == -1);
+    ret = tfs_unlink("/f");
+    assert(ret == -1);
+
+    // Still usable through its handle
+    written = tfs_write(orphan, data + FILE_LEN - 1, 1);
+    assert(written == 1);
+    ssize_t read = tfs_pread(orphan, buffer, FILE_LEN, 0);
+    assert(read == FILE_LEN && memcmp(buffer, data, FILE_LEN) == 0);
+
+    // A new file by the same name is another file, which can't have the
+    // orphan's blocks yet
+    fhandle = tfs_open("/f", TFS_O_CREAT);
+    assert(fhandle != -1 && fhandle != orphan);
+    written = tfs_write(fhandle, other, FILE_LEN);
+    assert(written >= 0 && written < FILE_LEN);
+    read = tfs_pread(orphan, buffer, FILE_LEN, 0);
+    assert(read == FILE_LEN && memcmp(buffer, data, FILE_LEN) == 0);
+
+    // Once it's closed, they're free
+    ret = tfs_close(orphan);
+    assert(ret != -1);
+    size_t rest = FILE_LEN - (size_t)written;
+    ssize_t written_rest = tfs_write(fhandle, other + written, rest);
+    assert(written_rest == (ssize_t)rest);
+    read = tfs_pread(fhandle, buffer, FILE_LEN, 0);
+    assert(read == FILE_LEN && memcmp(buffer, other, FILE_LEN) == 0);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
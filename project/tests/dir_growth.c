@@ -0,0 +1,120 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The root directory grows past its first block as files are created, and
+// every name is found by its index, before and after files are deleted (and
+// their entries reused), and after the index is rebuilt from the image
+
+#define FILE_COUNT (600)
+
+static char const *const image_path = "/tmp/tfs_dir_growth.img";
+static char const *const journal_path = "/tmp/tfs_dir_growth.img.journal";
+
+static size_t listed;
+
+static void count_file(char const *name, size_t size, void *arg) {
+    (void)name;
+    (void)size;
+    (void)arg;
+    listed++;
+}
+
+static void file_name(char *path, size_t size, char const *prefix, int i) {
+    int len = snprintf(path, size, "/%s%d", prefix, i);
+    assert(len > 0 && (size_t)len < size);
+}
+
+/**
+ * Check which files can be opened: the "f" files whose number isn't a
+ * multiple of deleted_every (if it's not 0), and the first new_count "n"
+ * files.
+ */
+static void check_files(int deleted_every, int new_count) {
+    char path[MAX_FILE_NAME];
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        file_name(path, sizeof(path), "f", i);
+        int fhandle = tfs_open(path, 0);
+        bool deleted = deleted_every != 0 && i % deleted_every == 0;
+        assert((fhandle == -1) == deleted);
+        if (fhandle != -1) {
+            int ret = tfs_close(fhandle);
+            assert(ret != -1);
+        }
+    }
+    for (int i = 0; i < FILE_COUNT; i++) {
+        file_name(path, sizeof(path), "n", i);
+        int fhandle = tfs_open(path, 0);
+        assert((fhandle != -1) == (i < new_count));
+        if (fhandle != -1) {
+            int ret = tfs_close(fhandle);
+            assert(ret != -1);
+        }
+    }
+
+    listed = 0;
+    int ret = tfs_list(count_file, NULL);
+    assert(ret != -1);
+    int deleted = deleted_every == 0 ? 0 : FILE_COUNT / deleted_every;
+    assert(listed == (size_t)(FILE_COUNT - deleted + new_count));
+}
+
+int main() {
+    unlink(image_path);
+    unlink(journal_path);
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2 * FILE_COUNT;
+    params.max_open_files_count = 4;
+    params.image_path = image_path;
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILE_COUNT; i++) {
+        file_name(path, sizeof(path), "f", i);
+        int fhandle = tfs_open(path, TFS_O_CREAT);
+        assert(fhandle != -1);
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+    check_files(0, 0);
+
+    // Deleting every third file leaves the rest where they are, and the new
+    // files take their entries
+    for (int i = 0; i < FILE_COUNT; i += 3) {
+        file_name(path, sizeof(path), "f", i);
+        ret = tfs_unlink(path);
+        assert(ret != -1);
+    }
+    check_files(3, 0);
+    for (int i = 0; i < FILE_COUNT / 3; i++) {
+        file_name(path, sizeof(path), "n", i);
+        int fhandle = tfs_open(path, TFS_O_CREAT);
+        assert(fhandle != -1);
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+    check_files(3, FILE_COUNT / 3);
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    ret = tfs_init(&params);
+    assert(ret != -1);
+    check_files(3, FILE_COUNT / 3);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "locks.h"
+#include "state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Scaling benchmark of the per-inode and per-open file hot state, with each
+// thread using its own file: the padded layout (inode_sync_t and
+// open_file_entry_t, each alone in its cache line) against the packed one they
+// replaced (an array of locks, and arrays of counters, next to each other, and
+// unaligned open file entries), where neighbouring files share cache lines.
+// The difference only shows with as many cores as threads.
+
+#define ITERATIONS (20000)
+#define MAX_THREADS (64)
+
+/**
+ * Open file entry, as it was before being padded
+ */
+typedef struct {
+    int of_inumber;
+    size_t of_offset;
+    pthread_mutex_t lock;
+} packed_open_file_entry_t;
+
+/**
+ * The hot state of one thread's file, in either layout
+ */
+typedef struct {
+    pthread_rwlock_t *lock;
+    atomic_uint *seq;
+    atomic_uint *leases;
+    pthread_mutex_t *of_lock;
+    size_t *of_offset;
+} hot_state_t;
+
+static size_t const thread_counts[] = {1, 4, 16, 64};
+
+/**
+ * What a pread and a lease do with the hot state: take the open file entry,
+ * read the inode under its lock, and lease it.
+ */
+static void *worker(void *arg) {
+    hot_state_t const *state = arg;
+
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        mutex_lock(state->of_lock);
+        rwl_rdlock(state->lock);
+        (void)atomic_load_explicit(state->seq, memory_order_acquire);
+        rwl_unlock(state->lock);
+        *state->of_offset += 1;
+        mutex_unlock(state->of_lock);
+
+        atomic_fetch_add_explicit(state->leases, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(state->leases, 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/**
+ * Run the workers, one per file.
+ *
+ * Returns the throughput, in millions of iterations per second.
+ */
+static double run(hot_state_t *states, size_t thread_count) {
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < thread_count; i++) {
+        int ret = pthread_create(&tids[i], NULL, worker, &states[i]);
+        assert(ret == 0);
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        int ret = pthread_join(tids[i], NULL);
+        assert(ret == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)(thread_count * ITERATIONS) / seconds / 1e6;
+}
+
+int main() {
+    // Packed: separate arrays, as the inode locks and counters used to be
+    pthread_rwlock_t *locks = malloc(MAX_THREADS * sizeof(pthread_rwlock_t));
+    atomic_uint *seqs = malloc(MAX_THREADS * sizeof(atomic_uint));
+    atomic_uint *leases = malloc(MAX_THREADS * sizeof(atomic_uint));
+    packed_open_file_entry_t *packed_files =
+        malloc(MAX_THREADS * sizeof(packed_open_file_entry_t));
+    // Padded: the current layout
+    inode_sync_t *syncs =
+        aligned_alloc(CACHE_LINE_SIZE, MAX_THREADS * sizeof(inode_sync_t));
+    open_file_entry_t *files = aligned_alloc(
+        CACHE_LINE_SIZE, MAX_THREADS * sizeof(open_file_entry_t));
+    assert(locks != NULL && seqs != NULL && leases != NULL &&
+           packed_files != NULL && syncs != NULL && files != NULL);
+
+    hot_state_t packed[MAX_THREADS];
+    hot_state_t padded[MAX_THREADS];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        rwl_init(&locks[i]);
+        atomic_init(&seqs[i], 0);
+        atomic_init(&leases[i], 0);
+        mutex_init(&packed_files[i].lock);
+        packed_files[i].of_offset = 0;
+        packed[i] = (hot_state_t){&locks[i], &seqs[i], &leases[i],
+                                  &packed_files[i].lock,
+                                  &packed_files[i].of_offset};
+
+        rwl_init(&syncs[i].lock);
+        atomic_init(&syncs[i].seq, 0);
+        atomic_init(&syncs[i].leases, 0);
+        mutex_init(&files[i].lock);
+        files[i].of_offset = 0;
+        padded[i] = (hot_state_t){&syncs[i].lock, &syncs[i].seq,
+                                  &syncs[i].leases, &files[i].lock,
+                                  &files[i].of_offset};
+    }
+
+    printf("threads  packed (Mops/s)  padded (Mops/s)\n");
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(*thread_counts);
+         i++) {
+        size_t thread_count = thread_counts[i];
+        double packed_rate = run(packed, thread_count);
+        double padded_rate = run(padded, thread_count);
+        printf("%7zu  %15.2f  %15.2f\n", thread_count, packed_rate,
+               padded_rate);
+    }
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        rwl_destroy(&locks[i]);
+        mutex_destroy(&packed_files[i].lock);
+        rwl_destroy(&syncs[i].lock);
+        mutex_destroy(&files[i].lock);
+    }
+    free(locks);
+    free(seqs);
+    free(leases);
+    free(packed_files);
+    free(syncs);
+    free(files);
+
+    return 0;
+}
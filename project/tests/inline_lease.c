@@ -0,0 +1,66 @@
+#include "config.h"
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// A lease on a file whose data is still in its inode stays valid, without
+// holding anyone back, while the file is overwritten in place and then
+// appended to past INODE_INLINE_SIZE (moving the data to a block, over the
+// bytes in the inode)
+
+#define INLINE_LEN (INODE_INLINE_SIZE - 28)
+#define APPEND_LEN (2 * INODE_INLINE_SIZE)
+
+static char const *const path = "/f";
+static char inline_data[INLINE_LEN];
+static char overwritten[INLINE_LEN];
+static char appended[APPEND_LEN];
+
+int main() {
+    for (size_t i = 0; i < INLINE_LEN; i++) {
+        inline_data[i] = (char)('a' + i % 26);
+    }
+    memset(overwritten, 'O', INLINE_LEN);
+    memset(appended, 'Z', APPEND_LEN);
+
+    int ret = tfs_init(NULL);
+    assert(ret != -1);
+
+    int fhandle = tfs_open(path, TFS_O_CREAT);
+    assert(fhandle != -1);
+    ssize_t written = tfs_write(fhandle, inline_data, INLINE_LEN);
+    assert(written == INLINE_LEN);
+
+    tfs_lease_t lease;
+    ret = tfs_read_lease(fhandle, &lease, INLINE_LEN, 0);
+    assert(ret == 0 && lease.len == INLINE_LEN);
+
+    // Neither write waits for the lease (this thread holds it), and both leave
+    // its bytes as they were
+    written = tfs_pwrite(fhandle, overwritten, INLINE_LEN, 0);
+    assert(written == INLINE_LEN);
+    assert(memcmp(lease.data, inline_data, INLINE_LEN) == 0);
+
+    written = tfs_pwrite(fhandle, appended, APPEND_LEN, INLINE_LEN);
+    assert(written == APPEND_LEN);
+    assert(memcmp(lease.data, inline_data, INLINE_LEN) == 0);
+
+    ret = tfs_release_lease(&lease);
+    assert(ret == 0);
+
+    char buffer[INLINE_LEN + APPEND_LEN];
+    ssize_t read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+    assert(read == (ssize_t)sizeof(buffer));
+    assert(memcmp(buffer, overwritten, INLINE_LEN) == 0);
+    assert(memcmp(buffer + INLINE_LEN, appended, APPEND_LEN) == 0);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
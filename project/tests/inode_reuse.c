@@ -0,0 +1,106 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The inodes of deleted files are allocated again, to new files, as long as
+// there are free ones, both before and after the FS is loaded back from its
+// image (which rebuilds the free inodes' stack)
+
+#define INODE_COUNT (8)
+
+static char const *const image_path = "/tmp/tfs_inode_reuse.img";
+static char const *const journal_path = "/tmp/tfs_inode_reuse.img.journal";
+
+/**
+ * Create a file holding its own name.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int create_file(char const *path) {
+    int fhandle = tfs_open(path, TFS_O_CREAT);
+    if (fhandle == -1) {
+        return -1;
+    }
+    ssize_t written = tfs_write(fhandle, path, strlen(path));
+    assert(written == (ssize_t)strlen(path));
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+    return 0;
+}
+
+static void check_file(char const *path) {
+    char buffer[MAX_FILE_NAME];
+    int fhandle = tfs_open(path, 0);
+    assert(fhandle != -1);
+    ssize_t read = tfs_read(fhandle, buffer, sizeof(buffer));
+    assert(read == (ssize_t)strlen(path));
+    assert(memcmp(buffer, path, strlen(path)) == 0);
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+int main() {
+    unlink(image_path);
+    unlink(journal_path);
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODE_COUNT;
+    params.image_path = image_path;
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    // Every inode but the root directory's is taken
+    char path[] = "/f0";
+    for (int i = 0; i < INODE_COUNT - 1; i++) {
+        path[2] = (char)('0' + i);
+        ret = create_file(path);
+        assert(ret != -1);
+    }
+    ret = create_file("/full");
+    assert(ret == -1);
+
+    // As many files as were deleted can be created
+    ret = tfs_unlink("/f2");
+    assert(ret != -1);
+    ret = tfs_unlink("/f5");
+    assert(ret != -1);
+    ret = create_file("/g0");
+    assert(ret != -1);
+    ret = create_file("/g1");
+    assert(ret != -1);
+    ret = create_file("/full");
+    assert(ret == -1);
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    // And so after loading the image
+    ret = tfs_init(&params);
+    assert(ret != -1);
+    ret = create_file("/full");
+    assert(ret == -1);
+    ret = tfs_unlink("/f0");
+    assert(ret != -1);
+    ret = create_file("/h0");
+    assert(ret != -1);
+    ret = create_file("/full");
+    assert(ret == -1);
+
+    check_file("/f1");
+    check_file("/g0");
+    check_file("/g1");
+    check_file("/h0");
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    unlink(image_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
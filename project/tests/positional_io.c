@@ -0,0 +1,115 @@
+#include "operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// tfs_pread and tfs_pwrite read and write where they're told to (across block
+// boundaries, and past the end of the file, leaving a gap of zeros) without
+// moving the handle's offset, and several threads can use one handle at once
+
+#define FILE_LEN (3000)
+#define GAP_OFFSET (5000)
+#define THREAD_COUNT (4)
+#define THREAD_LEN (1000)
+#define CHUNK_LEN (100)
+
+static char model[GAP_OFFSET + 10];
+
+typedef struct {
+    int fhandle;
+    size_t index;
+} worker_args_t;
+
+static void *worker(void *arg) {
+    worker_args_t const *args = arg;
+    char chunk[CHUNK_LEN];
+    memset(chunk, 'A' + (int)args->index, CHUNK_LEN);
+
+    for (size_t offset = args->index * THREAD_LEN;
+         offset < (args->index + 1) * THREAD_LEN; offset += CHUNK_LEN) {
+        ssize_t written = tfs_pwrite(args->fhandle, chunk, CHUNK_LEN, offset);
+        assert(written == CHUNK_LEN);
+    }
+
+    return NULL;
+}
+
+int main() {
+    static char buffer[sizeof(model)];
+
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int fhandle = tfs_open("/f", TFS_O_CREAT);
+    assert(fhandle != -1);
+    for (size_t i = 0; i < FILE_LEN; i++) {
+        model[i] = (char)('0' + i % 10);
+    }
+    ssize_t written = tfs_write(fhandle, model, FILE_LEN);
+    assert(written == FILE_LEN);
+
+    // Over the end of the first block
+    memset(model + 900, 'P', 500);
+    written = tfs_pwrite(fhandle, model + 900, 500, 900);
+    assert(written == 500);
+
+    // Past the end of the file
+    memcpy(model + GAP_OFFSET, "0123456789", 10);
+    written = tfs_pwrite(fhandle, model + GAP_OFFSET, 10, GAP_OFFSET);
+    assert(written == 10);
+
+    // The handle's offset is still at the end of the first write
+    memcpy(model + FILE_LEN, "tail", 4);
+    written = tfs_write(fhandle, "tail", 4);
+    assert(written == 4);
+
+    ssize_t read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+    assert(read == (ssize_t)sizeof(model));
+    assert(memcmp(buffer, model, sizeof(model)) == 0);
+
+    read = tfs_pread(fhandle, buffer, 100, GAP_OFFSET + 5);
+    assert(read == 5 && memcmp(buffer, "56789", 5) == 0);
+    read = tfs_pread(fhandle, buffer, 100, sizeof(model) + 100);
+    assert(read == 0);
+
+    // Nor did the preads move it
+    read = tfs_read(fhandle, buffer, 10);
+    assert(read == 10);
+    assert(memcmp(buffer, model + FILE_LEN + 4, 10) == 0);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+
+    // Threads writing their own parts of a file through the same handle
+    fhandle = tfs_open("/shared", TFS_O_CREAT);
+    assert(fhandle != -1);
+    pthread_t tids[THREAD_COUNT];
+    worker_args_t args[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        args[i] = (worker_args_t){.fhandle = fhandle, .index = i};
+        ret = pthread_create(&tids[i], NULL, worker, &args[i]);
+        assert(ret == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        ret = pthread_join(tids[i], NULL);
+        assert(ret == 0);
+    }
+
+    read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+    assert(read == THREAD_COUNT * THREAD_LEN);
+    for (size_t i = 0; i < THREAD_COUNT * THREAD_LEN; i++) {
+        assert(buffer[i] == 'A' + (int)(i / THREAD_LEN));
+    }
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
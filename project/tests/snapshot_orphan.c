@@ -0,0 +1,64 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// A snapshot taken while an unlinked file is still open doesn't keep that
+// file's inode and blocks taken once it's loaded
+
+#define FILE_LEN (4000)
+
+static char const *const snapshot_path = "/tmp/tfs_snapshot_orphan.img";
+static char const *const journal_path = "/tmp/tfs_snapshot_orphan.img.journal";
+
+int main() {
+    static char data[FILE_LEN];
+    memset(data, 'd', FILE_LEN);
+    unlink(snapshot_path);
+    unlink(journal_path);
+
+    // Room for the root directory, the orphan and one more file
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 3;
+    params.max_block_count = 8;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int orphan = tfs_open("/orphan", TFS_O_CREAT);
+    assert(orphan != -1);
+    ssize_t written = tfs_write(orphan, data, FILE_LEN);
+    assert(written == FILE_LEN);
+    ret = tfs_unlink("/orphan");
+    assert(ret != -1);
+
+    ret = tfs_snapshot(snapshot_path);
+    assert(ret != -1);
+    ret = tfs_close(orphan);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    // The orphan's inode and blocks are free in the snapshot
+    params.image_path = snapshot_path;
+    ret = tfs_init(&params);
+    assert(ret != -1);
+    for (int i = 0; i < 2; i++) {
+        char name[] = {'/', (char)('a' + i), '\0'};
+        int fhandle = tfs_open(name, TFS_O_CREAT);
+        assert(fhandle != -1);
+        written = tfs_write(fhandle, data, i == 0 ? FILE_LEN : 1);
+        assert(written == (i == 0 ? FILE_LEN : 1));
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    unlink(snapshot_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
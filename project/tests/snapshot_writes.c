@@ -0,0 +1,121 @@
+#include "operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// A snapshot taken while a thread keeps appending records to a file holds the
+// file as it was at some point: whole records, in order, with none missing;
+// and a file overwritten once the snapshot is taken keeps its old contents in
+// the snapshot
+
+#define RECORD_LEN (100)
+#define RECORDS_BEFORE (50)
+#define RECORD_COUNT (2000)
+#define OLD_LEN (3000)
+
+static char const *const snapshot_path = "/tmp/tfs_snapshot_writes.img";
+static char const *const journal_path = "/tmp/tfs_snapshot_writes.img.journal";
+
+static atomic_bool writer_done;
+
+static void make_record(char *record, size_t i) {
+    memset(record, ' ', RECORD_LEN);
+    int len = snprintf(record, RECORD_LEN, "record %zu", i);
+    assert(len > 0 && len < RECORD_LEN);
+    record[RECORD_LEN - 1] = '\n';
+}
+
+static void append_records(int fhandle, size_t from, size_t to) {
+    char record[RECORD_LEN];
+    for (size_t i = from; i < to; i++) {
+        make_record(record, i);
+        ssize_t written = tfs_write(fhandle, record, RECORD_LEN);
+        assert(written == RECORD_LEN);
+    }
+}
+
+static void *writer(void *arg) {
+    int fhandle = *(int const *)arg;
+    append_records(fhandle, RECORDS_BEFORE, RECORD_COUNT);
+    atomic_store(&writer_done, true);
+    return NULL;
+}
+
+int main() {
+    static char old_data[OLD_LEN], new_data[OLD_LEN];
+    static char buffer[RECORD_COUNT * RECORD_LEN];
+    memset(old_data, 'o', OLD_LEN);
+    memset(new_data, 'n', OLD_LEN);
+    unlink(snapshot_path);
+    unlink(journal_path);
+
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int old_fhandle = tfs_open("/old", TFS_O_CREAT);
+    assert(old_fhandle != -1);
+    ssize_t written = tfs_write(old_fhandle, old_data, OLD_LEN);
+    assert(written == OLD_LEN);
+
+    int log_fhandle = tfs_open("/log", TFS_O_CREAT);
+    assert(log_fhandle != -1);
+    append_records(log_fhandle, 0, RECORDS_BEFORE);
+
+    pthread_t tid;
+    ret = pthread_create(&tid, NULL, writer, &log_fhandle);
+    assert(ret == 0);
+    ret = tfs_snapshot(snapshot_path);
+    assert(ret != -1);
+    bool done_after_snapshot = atomic_load(&writer_done);
+    written = tfs_pwrite(old_fhandle, new_data, OLD_LEN, 0);
+    assert(written == OLD_LEN);
+    ret = pthread_join(tid, NULL);
+    assert(ret == 0);
+
+    ret = tfs_close(log_fhandle);
+    assert(ret != -1);
+    ret = tfs_close(old_fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    params.image_path = snapshot_path;
+    ret = tfs_init(&params);
+    assert(ret != -1);
+
+    old_fhandle = tfs_open("/old", 0);
+    assert(old_fhandle != -1);
+    ssize_t read = tfs_read(old_fhandle, buffer, sizeof(buffer));
+    assert(read == OLD_LEN && memcmp(buffer, old_data, OLD_LEN) == 0);
+
+    log_fhandle = tfs_open("/log", 0);
+    assert(log_fhandle != -1);
+    read = tfs_read(log_fhandle, buffer, sizeof(buffer));
+    assert(read >= RECORDS_BEFORE * RECORD_LEN && read % RECORD_LEN == 0);
+    assert(!done_after_snapshot || read == RECORD_COUNT * RECORD_LEN);
+    char record[RECORD_LEN];
+    for (size_t i = 0; i < (size_t)read / RECORD_LEN; i++) {
+        make_record(record, i);
+        assert(memcmp(buffer + i * RECORD_LEN, record, RECORD_LEN) == 0);
+    }
+
+    ret = tfs_close(log_fhandle);
+    assert(ret != -1);
+    ret = tfs_close(old_fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    unlink(snapshot_path);
+    unlink(journal_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
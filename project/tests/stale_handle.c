@@ -0,0 +1,99 @@
+#include "operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// A closed file handle stays invalid once its slot in the open file table is
+// reused by another open, and threads opening and closing files at once, with
+// fewer slots than threads, each get slots of their own
+
+#define THREAD_COUNT (4)
+#define ROUNDS (200)
+
+static char const *const paths[THREAD_COUNT] = {"/t0", "/t1", "/t2", "/t3"};
+
+static void *worker(void *arg) {
+    char const *path = arg;
+    char buffer[MAX_FILE_NAME];
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        int fhandle;
+        do {
+            fhandle = tfs_open(path, 0); // fails while every slot is taken
+        } while (fhandle == -1);
+
+        ssize_t read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+        assert(read == (ssize_t)strlen(path));
+        assert(memcmp(buffer, path, strlen(path)) == 0);
+
+        int ret = tfs_close(fhandle);
+        assert(ret != -1);
+        ret = tfs_close(fhandle);
+        assert(ret == -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = 2;
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        int fhandle = tfs_open(paths[i], TFS_O_CREAT);
+        assert(fhandle != -1);
+        ssize_t written = tfs_write(fhandle, paths[i], strlen(paths[i]));
+        assert(written == (ssize_t)strlen(paths[i]));
+        ret = tfs_close(fhandle);
+        assert(ret != -1);
+    }
+
+    // The old handle doesn't reach the file now open in its slot (one of the
+    // two taken)
+    int stale = tfs_open(paths[0], 0);
+    assert(stale != -1);
+    ret = tfs_close(stale);
+    assert(ret != -1);
+    int fhandle = tfs_open(paths[1], 0);
+    assert(fhandle != -1 && fhandle != stale);
+    int other_fhandle = tfs_open(paths[2], 0);
+    assert(other_fhandle != -1 && other_fhandle != stale);
+
+    char buffer[MAX_FILE_NAME];
+    ssize_t read = tfs_read(stale, buffer, sizeof(buffer));
+    assert(read == -1);
+    ssize_t written = tfs_write(stale, "x", 1);
+    assert(written == -1);
+    ret = tfs_close(stale);
+    assert(ret == -1);
+
+    read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+    assert(read == (ssize_t)strlen(paths[1]));
+    read = tfs_pread(other_fhandle, buffer, sizeof(buffer), 0);
+    assert(read == (ssize_t)strlen(paths[2]));
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_close(other_fhandle);
+    assert(ret != -1);
+
+    pthread_t tids[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        ret = pthread_create(&tids[i], NULL, worker, (void *)paths[i]);
+        assert(ret == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        ret = pthread_join(tids[i], NULL);
+        assert(ret == 0);
+    }
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Opening a symlink (whose resolution is cached) always reaches the file its
+// chain names now: after the target is deleted and created again, after it's
+// deleted for good, and after it's created back; chains of up to
+// SYMLINK_MAX_DEPTH symlinks are followed, and longer ones and loops fail
+
+/**
+ * Create a file holding some data.
+ */
+static void write_file(char const *path, char const *data) {
+    int fhandle = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fhandle != -1);
+    ssize_t written = tfs_write(fhandle, data, strlen(data));
+    assert(written == (ssize_t)strlen(data));
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+/**
+ * Check what a file opened by its path holds, or that it can't be opened if
+ * data is NULL.
+ */
+static void check_file(char const *path, char const *data) {
+    char buffer[MAX_FILE_NAME];
+    int fhandle = tfs_open(path, 0);
+    if (data == NULL) {
+        assert(fhandle == -1);
+        return;
+    }
+    assert(fhandle != -1);
+    ssize_t read = tfs_read(fhandle, buffer, sizeof(buffer));
+    assert(read == (ssize_t)strlen(data));
+    assert(memcmp(buffer, data, strlen(data)) == 0);
+    int ret = tfs_close(fhandle);
+    assert(ret != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    write_file("/a", "first");
+    ret = tfs_sym_link("/a", "/s");
+    assert(ret != -1);
+    ret = tfs_sym_link("/s", "/s2");
+    assert(ret != -1);
+    check_file("/s", "first");
+    check_file("/s2", "first");
+
+    // Other files being created doesn't change where it leads
+    write_file("/b", "other");
+    check_file("/s", "first");
+
+    // The target deleted and created again
+    ret = tfs_unlink("/a");
+    assert(ret != -1);
+    write_file("/a", "second");
+    check_file("/s", "second");
+    check_file("/s2", "second");
+
+    // Deleted for good, and then created back
+    ret = tfs_unlink("/a");
+    assert(ret != -1);
+    check_file("/s", NULL);
+    check_file("/s2", NULL);
+    write_file("/a", "third");
+    check_file("/s2", "third");
+
+    // A symlink in the middle of the chain deleted and created again,
+    // elsewhere
+    ret = tfs_unlink("/s");
+    assert(ret != -1);
+    check_file("/s2", NULL);
+    ret = tfs_sym_link("/b", "/s");
+    assert(ret != -1);
+    check_file("/s2", "other");
+
+    // "/l1" leads to "/a" through 1 symlink, "/l2" through 2, and so on
+    char target[MAX_FILE_NAME] = "/a";
+    for (int depth = 1; depth <= SYMLINK_MAX_DEPTH + 1; depth++) {
+        char name[MAX_FILE_NAME];
+        int len = snprintf(name, sizeof(name), "/l%d", depth);
+        assert(len > 0);
+        ret = tfs_sym_link(target, name);
+        assert(ret != -1);
+        check_file(name, depth <= SYMLINK_MAX_DEPTH ? "third" : NULL);
+        strcpy(target, name);
+    }
+
+    // A loop
+    ret = tfs_sym_link("/y", "/x");
+    assert(ret != -1);
+    ret = tfs_sym_link("/x", "/y");
+    assert(ret != -1);
+    check_file("/x", NULL);
+
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
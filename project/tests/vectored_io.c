@@ -0,0 +1,98 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// tfs_writev and tfs_readv move the data between the file and the buffers in
+// order (empty buffers included), across block boundaries and from inline
+// data into a block, as a single write or read would; tfs_pwritev and
+// tfs_preadv do so at an offset, without moving the handle's offset
+
+#define FILE_LEN (2500)
+
+static char model[FILE_LEN];
+
+int main() {
+    static char part_a[700], part_b[1500], part_c[300];
+    static char buffer[FILE_LEN];
+
+    memset(part_a, 'a', sizeof(part_a));
+    memset(part_b, 'b', sizeof(part_b));
+    memset(part_c, 'c', sizeof(part_c));
+    memcpy(model, part_a, sizeof(part_a));
+    memcpy(model + 700, part_b, sizeof(part_b));
+    memcpy(model + 2200, part_c, sizeof(part_c));
+
+    tfs_params params = tfs_default_params();
+    params.latency_model = TFS_LATENCY_NONE;
+    int ret = tfs_init(&params);
+    assert(ret != -1);
+
+    int fhandle = tfs_open("/f", TFS_O_CREAT);
+    assert(fhandle != -1);
+
+    // A short first write, kept in the inode, then one spanning 3 blocks
+    struct iovec head_iov[] = {{part_a, 50}, {NULL, 0}, {part_a + 50, 50}};
+    ssize_t written = tfs_writev(fhandle, head_iov, 3);
+    assert(written == 100);
+    struct iovec rest_iov[] = {{part_a + 100, 600},
+                               {part_b, sizeof(part_b)},
+                               {NULL, 0},
+                               {part_c, sizeof(part_c)}};
+    written = tfs_writev(fhandle, rest_iov, 4);
+    assert(written == FILE_LEN - 100);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    fhandle = tfs_open("/f", 0);
+    assert(fhandle != -1);
+
+    // Uneven buffers, the last one past the end of the file
+    static char read_a[1000], read_b[24], read_c[2000];
+    struct iovec read_iov[] = {{read_a, sizeof(read_a)},
+                               {read_b, sizeof(read_b)},
+                               {NULL, 0},
+                               {read_c, sizeof(read_c)}};
+    ssize_t read = tfs_readv(fhandle, read_iov, 4);
+    assert(read == FILE_LEN);
+    assert(memcmp(read_a, model, 1000) == 0);
+    assert(memcmp(read_b, model + 1000, 24) == 0);
+    assert(memcmp(read_c, model + 1024, FILE_LEN - 1024) == 0);
+    read = tfs_readv(fhandle, read_iov, 4);
+    assert(read == 0);
+
+    // At an offset
+    memcpy(model + 1020, "xyzw", 4);
+    memcpy(model + 1024, "XYZW", 4);
+    struct iovec patch_iov[] = {{"xyzw", 4}, {"XYZW", 4}};
+    written = tfs_pwritev(fhandle, patch_iov, 2, 1020);
+    assert(written == 8);
+
+    struct iovec around_iov[] = {{read_a, 10}, {read_b, 10}};
+    read = tfs_preadv(fhandle, around_iov, 2, 1014);
+    assert(read == 20);
+    assert(memcmp(read_a, model + 1014, 10) == 0);
+    assert(memcmp(read_b, model + 1024, 10) == 0);
+
+    // Neither used the handle's offset, still at the end of the file
+    read = tfs_read(fhandle, buffer, sizeof(buffer));
+    assert(read == 0);
+
+    read = tfs_pread(fhandle, buffer, sizeof(buffer), 0);
+    assert(read == FILE_LEN && memcmp(buffer, model, FILE_LEN) == 0);
+
+    // No buffers, and a negative count
+    written = tfs_writev(fhandle, patch_iov, 0);
+    assert(written == 0);
+    written = tfs_writev(fhandle, patch_iov, -1);
+    assert(written == -1);
+
+    ret = tfs_close(fhandle);
+    assert(ret != -1);
+    ret = tfs_destroy();
+    assert(ret != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}